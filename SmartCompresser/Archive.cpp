@@ -0,0 +1,351 @@
+#pragma once
+
+#include "stdafx.h"
+#include "WorkerPool.cpp"
+#include "MappedFile.cpp"
+#include "MemoryStream.cpp"
+#include <cstdio>
+
+/// Multi-file container. Members are complete compressed files (key byte included)
+/// stored back to back, followed by a central directory and a fixed size footer:
+///
+///   "SCA1" | member 0 | member 1 | ... | directory | directory offset (u64) | "SCA1"
+///
+/// Listing only reads the footer and the directory, and a member is decoded straight
+/// from its range of the mapped archive. Members are named by the base name of their
+/// file, and only names that stay inside the output directory are accepted. Worker is
+/// the per-thread codec context; it has to provide compressMember(data, size, os, mode),
+/// decompressStream(is, os) and testBuffer(data, size, decodedSize).
+template <class Worker>
+class Archive
+{
+public:
+	struct Member
+	{
+		std::string name;
+		std::uint64_t size;           // original size
+		std::uint64_t offset;         // from the start of the archive
+		std::uint64_t compressedSize;
+		char codec;                   // key byte of the member
+	};
+
+	int open(const std::string& path)
+	{
+		archivePath = path;
+		members.clear();
+
+		std::ifstream is(path, std::ios_base::binary);
+		if (!is.is_open())
+			return EXIT_FAILURE;
+
+		std::uint64_t directoryOffset = 0;
+		char magic[MagicSize];
+
+		is.seekg(-static_cast<std::streamoff>(sizeof(directoryOffset) + MagicSize), std::ios::end);
+		is.read(reinterpret_cast<char *>(&directoryOffset), sizeof(directoryOffset));
+		is.read(magic, MagicSize);
+
+		if (!is || !std::equal(magic, magic + MagicSize, Magic()))
+			return EXIT_FAILURE;
+
+		// Members lie between the leading magic and the directory.
+		const std::uint64_t footerOffset = static_cast<std::uint64_t>(is.tellg()) - sizeof(directoryOffset) - MagicSize;
+		if (directoryOffset < MagicSize || directoryOffset > footerOffset)
+			return EXIT_FAILURE;
+
+		is.seekg(static_cast<std::streamoff>(directoryOffset), std::ios::beg);
+
+		std::uint32_t count = 0;
+		is.read(reinterpret_cast<char *>(&count), sizeof(count));
+
+		for (std::uint32_t i = 0; i < count && is; ++i)
+		{
+			Member member;
+			std::uint16_t nameLength = 0;
+
+			is.read(reinterpret_cast<char *>(&nameLength), sizeof(nameLength));
+			member.name.resize(nameLength);
+			if (nameLength > 0)
+				is.read(&member.name[0], nameLength);
+
+			is.read(reinterpret_cast<char *>(&member.size), sizeof(member.size));
+			is.read(reinterpret_cast<char *>(&member.offset), sizeof(member.offset));
+			is.read(reinterpret_cast<char *>(&member.compressedSize), sizeof(member.compressedSize));
+			is.get(member.codec);
+
+			if (!is || !validName(member.name) || find(member.name) != nullptr || member.offset < MagicSize
+				|| member.offset > directoryOffset || member.compressedSize > directoryOffset - member.offset)
+				return EXIT_FAILURE;
+
+			members.push_back(member);
+		}
+
+		return is ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/// A name extracts to a file directly inside the output directory: not empty, no
+	/// separators, no "..", nothing a path could be resolved against.
+	static bool validName(const std::string& name)
+	{
+		return !name.empty() && name != "." && name.find("..") == std::string::npos
+			&& name.find_first_of(std::string("/\\:\0", 4)) == std::string::npos;
+	}
+
+	const std::vector<Member>& getMembers() const
+	{
+		return members;
+	}
+
+	const Member* find(const std::string& name) const
+	{
+		for (const auto& member : members)
+		{
+			if (member.name == name)
+				return &member;
+		}
+
+		return nullptr;
+	}
+
+	/// Decodes only that member, from its range of the mapped archive to output.
+	int extract(const Member& member, const std::string& output, Worker& worker) const
+	{
+		MappedFile mapped;
+		if (!mapped.open(archivePath))
+			return EXIT_FAILURE;
+
+		return extract(mapped, member, output, worker);
+	}
+
+	int extractAll(const std::string& outputDir, WorkerPool<Worker>& pool) const
+	{
+		MappedFile mapped;
+		if (!mapped.open(archivePath))
+			return EXIT_FAILURE;
+
+		std::atomic<size_t> failures(0);
+
+		pool.run(members.size(), [&](Worker& worker, size_t job)
+		{
+			if (extract(mapped, members[job], outputDir + "/" + members[job].name, worker) != EXIT_SUCCESS)
+				failures++;
+		});
+
+		return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/// Decodes every member in place from the mapped archive, in parallel and without
+	/// writing anything, and checks it against the size in the directory.
+	int test(WorkerPool<Worker>& pool, std::uint64_t& decodedSize) const
+	{
+		MappedFile mapped;
+		if (!mapped.open(archivePath))
+			return EXIT_FAILURE;
+
+		std::atomic<size_t> failures(0);
+		std::atomic<std::uint64_t> decoded(0);
+
+		pool.run(members.size(), [&](Worker& worker, size_t job)
+		{
+			const Member& member = members[job];
+			std::uint64_t size = 0;
+
+			if (member.offset > mapped.size() || member.compressedSize > mapped.size() - member.offset
+				|| worker.testBuffer(mapped.data() + member.offset, static_cast<size_t>(member.compressedSize), size) != EXIT_SUCCESS
+				|| size != member.size)
+			{
+				std::cout << member.name << " is damaged" << std::endl;
+				failures++;
+			}
+
+			decoded += size;
+		});
+
+		decodedSize = decoded;
+		return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/// Compresses the files on the pool a round of pool.size() files at a time, each into
+	/// a part file of its worker next to the archive, and copies each round into the
+	/// archive in input order. Memory does not grow with the members, only the disk
+	/// holds a round twice.
+	template <class Mode>
+	static int create(const std::string& path, const std::vector<std::string>& files, Mode mode, WorkerPool<Worker>& pool)
+	{
+		std::vector<Member> directory(files.size());
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			const size_t separator = files[i].find_last_of("/\\");
+			directory[i].name = separator == std::string::npos ? files[i] : files[i].substr(separator + 1);
+
+			if (!validName(directory[i].name))
+			{
+				std::cout << "Cannot store " << files[i] << " under the name " << directory[i].name << std::endl;
+				return EXIT_FAILURE;
+			}
+
+			for (size_t j = 0; j < i; ++j)
+			{
+				if (directory[j].name == directory[i].name)
+				{
+					std::cout << files[j] << " and " << files[i] << " have the same name " << directory[i].name << std::endl;
+					return EXIT_FAILURE;
+				}
+			}
+		}
+
+		std::ofstream os(path, std::ios_base::binary);
+		if (!os.is_open())
+			return EXIT_FAILURE;
+
+		os.write(Magic(), MagicSize);
+
+		std::vector<std::string> parts(pool.size());
+		for (size_t job = 0; job < parts.size(); ++job)
+			parts[job] = path + ".part" + std::to_string(job);
+
+		std::vector<char> buffer(CopySize);
+		std::atomic<size_t> failures(0);
+
+		for (size_t first = 0; first < files.size() && failures == 0 && os; first += parts.size())
+		{
+			const size_t count = std::min(parts.size(), files.size() - first);
+
+			pool.run(count, [&](Worker& worker, size_t job)
+			{
+				MappedFile mapped;
+				std::vector<unsigned char> read;
+				const unsigned char* data = nullptr;
+				size_t size = 0;
+				Member& member = directory[first + job];
+
+				std::ofstream part(parts[job], std::ios_base::binary | std::ios_base::trunc);
+				if (!loadInput(files[first + job], mapped, read, data, size) || !part.is_open()
+					|| worker.compressMember(data, size, part, mode) != EXIT_SUCCESS || !part)
+				{
+					std::cout << "Failed: " << files[first + job] << std::endl;
+					failures++;
+				}
+
+				member.size = size;
+				member.compressedSize = static_cast<std::uint64_t>(part.tellp());
+			});
+
+			for (size_t job = 0; job < count && failures == 0; ++job)
+			{
+				Member& member = directory[first + job];
+				member.offset = static_cast<std::uint64_t>(os.tellp());
+
+				std::ifstream part(parts[job], std::ios_base::binary);
+				member.codec = member.compressedSize > 0 ? static_cast<char>(part.peek()) : 0;
+				if (!copy(part, member.compressedSize, os, buffer))
+					failures++;
+			}
+		}
+
+		for (const auto& part : parts)
+			std::remove(part.c_str());
+
+		if (failures != 0)
+		{
+			os.close();
+			std::remove(path.c_str());
+			return EXIT_FAILURE;
+		}
+
+		const std::uint64_t directoryOffset = static_cast<std::uint64_t>(os.tellp());
+		const std::uint32_t count = static_cast<std::uint32_t>(directory.size());
+
+		os.write(reinterpret_cast<const char *>(&count), sizeof(count));
+		for (const auto& member : directory)
+		{
+			const std::uint16_t nameLength = static_cast<std::uint16_t>(member.name.size());
+
+			os.write(reinterpret_cast<const char *>(&nameLength), sizeof(nameLength));
+			os.write(member.name.data(), nameLength);
+			os.write(reinterpret_cast<const char *>(&member.size), sizeof(member.size));
+			os.write(reinterpret_cast<const char *>(&member.offset), sizeof(member.offset));
+			os.write(reinterpret_cast<const char *>(&member.compressedSize), sizeof(member.compressedSize));
+			os.put(member.codec);
+		}
+
+		os.write(reinterpret_cast<const char *>(&directoryOffset), sizeof(directoryOffset));
+		os.write(Magic(), MagicSize);
+
+		return os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+private:
+	static const size_t MagicSize = 4;
+	static const size_t CopySize = 1 << 20;
+
+	std::string archivePath;
+	std::vector<Member> members;
+
+	static const char* Magic()
+	{
+		return "SCA1";
+	}
+
+	/// Maps the file, or reads it when it cannot be mapped (empty files among them).
+	static bool loadInput(const std::string& path, MappedFile& mapped, std::vector<unsigned char>& read,
+		const unsigned char*& data, size_t& size)
+	{
+		if (mapped.open(path))
+		{
+			data = mapped.data();
+			size = mapped.size();
+			return true;
+		}
+
+		std::ifstream is(path, std::ios_base::binary);
+		if (!is.is_open())
+			return false;
+
+		read.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+		data = read.data();
+		size = read.size();
+		return !is.bad();
+	}
+
+	/// Copies size bytes from is to os through buffer.
+	static bool copy(std::istream& is, std::uint64_t size, std::ostream& os, std::vector<char>& buffer)
+	{
+		while (size > 0 && is && os)
+		{
+			const size_t chunk = static_cast<size_t>(std::min<std::uint64_t>(size, buffer.size()));
+			is.read(buffer.data(), chunk);
+			os.write(buffer.data(), is.gcount());
+			size -= static_cast<std::uint64_t>(is.gcount());
+		}
+
+		return size == 0 && os;
+	}
+
+	/// The output is removed again when the member does not decode to its recorded size.
+	int extract(const MappedFile& mapped, const Member& member, const std::string& output, Worker& worker) const
+	{
+		if (member.offset > mapped.size() || member.compressedSize > mapped.size() - member.offset)
+			return EXIT_FAILURE;
+
+		MemoryInputBuffer buffer;
+		std::istream is(&buffer);
+		buffer.attach(mapped.data() + member.offset, static_cast<size_t>(member.compressedSize));
+
+		// Open for reading too: deduplicated members copy their references from the output.
+		std::fstream os(output, std::ios_base::binary | std::ios_base::in | std::ios_base::out | std::ios_base::trunc);
+		if (!os.is_open())
+			return EXIT_FAILURE;
+
+		const bool valid = worker.decompressStream(is, os) == EXIT_SUCCESS
+			&& static_cast<std::uint64_t>(os.tellp()) == member.size;
+		os.close();
+
+		if (valid)
+			return EXIT_SUCCESS;
+
+		std::cout << member.name << " is damaged" << std::endl;
+		std::remove(output.c_str());
+		return EXIT_FAILURE;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,566 @@
+#pragma once
+
+#include "stdafx.h"
+#include "BaseCompression.h"
+#include "Huffman.cpp"
+#include "MemoryStream.cpp"
+#include "WorkerPool.cpp"
+#include <cstring>
+
+/// Linear time suffix sorting (SA-IS, Nong, Zhang and Chan). text[n - 1] has to be a
+/// sentinel smaller than every other symbol and all symbols below alphabet. types and
+/// buckets are the caller's scratch space, sized here once for every recursion level.
+class SuffixArray
+{
+public:
+	static void build(const int* text, int* suffixes, int n, int alphabet, std::vector<char>& types, std::vector<int>& buckets)
+	{
+		// Each level has at most half the symbols of the one above, so the levels' types
+		// fit in 2n and every reduced alphabet in n / 2 buckets.
+		types.resize(2 * static_cast<size_t>(n));
+		buckets.resize(std::max(alphabet, n / 2 + 1));
+		sort(text, suffixes, n, alphabet, types.data(), buckets.data());
+	}
+
+private:
+	static void sort(const int* text, int* suffixes, int n, int alphabet, char* stype, int* buckets)
+	{
+		if (n == 1)
+		{
+			suffixes[0] = 0;
+			return;
+		}
+
+		// S-type suffixes are smaller than the one after them, L-type ones larger.
+		stype[n - 1] = 1;
+		for (int i = n - 2; i >= 0; --i)
+			stype[i] = text[i] < text[i + 1] || (text[i] == text[i + 1] && stype[i + 1]);
+
+		const auto lms = [stype](int i)
+		{
+			return i > 0 && stype[i] && !stype[i - 1];
+		};
+
+		// Sort the LMS substrings by inducing from their unsorted positions.
+		std::fill(suffixes, suffixes + n, -1);
+		bucketBounds(text, n, buckets, alphabet, true);
+		for (int i = 1; i < n; ++i)
+		{
+			if (lms(i))
+				suffixes[--buckets[text[i]]] = i;
+		}
+		induce(text, suffixes, n, stype, buckets, alphabet);
+
+		// Name them in sorted order, equal substrings share a name.
+		int count = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			if (lms(suffixes[i]))
+				suffixes[count++] = suffixes[i];
+		}
+
+		std::fill(suffixes + count, suffixes + n, -1);
+		int names = 0;
+		int previous = -1;
+		for (int i = 0; i < count; ++i)
+		{
+			const int position = suffixes[i];
+			bool differ = previous < 0;
+
+			for (int d = 0; !differ; ++d)
+			{
+				if (text[position + d] != text[previous + d] || stype[position + d] != stype[previous + d])
+					differ = true;
+				else if (d > 0 && (lms(position + d) || lms(previous + d)))
+					break;
+			}
+
+			if (differ)
+			{
+				++names;
+				previous = position;
+			}
+
+			// LMS positions are at least two apart, so position / 2 is a free slot.
+			suffixes[count + position / 2] = names - 1;
+		}
+
+		for (int i = n - 1, j = n - 1; i >= count; --i)
+		{
+			if (suffixes[i] >= 0)
+				suffixes[j--] = suffixes[i];
+		}
+
+		// Sort the reduced string, recursing only while names repeat.
+		int* reduced = suffixes + n - count;
+		if (names < count)
+			sort(reduced, suffixes, count, names, stype + n, buckets);
+		else
+		{
+			for (int i = 0; i < count; ++i)
+				suffixes[reduced[i]] = i;
+		}
+
+		// Put the sorted LMS suffixes at their bucket ends and induce the rest.
+		for (int i = 1, j = 0; i < n; ++i)
+		{
+			if (lms(i))
+				reduced[j++] = i;
+		}
+		for (int i = 0; i < count; ++i)
+			suffixes[i] = reduced[suffixes[i]];
+
+		std::fill(suffixes + count, suffixes + n, -1);
+		bucketBounds(text, n, buckets, alphabet, true);
+		for (int i = count - 1; i >= 0; --i)
+		{
+			const int position = suffixes[i];
+			suffixes[i] = -1;
+			suffixes[--buckets[text[position]]] = position;
+		}
+		induce(text, suffixes, n, stype, buckets, alphabet);
+	}
+
+	static void bucketBounds(const int* text, int n, int* buckets, int alphabet, bool ends)
+	{
+		std::fill(buckets, buckets + alphabet, 0);
+		for (int i = 0; i < n; ++i)
+			++buckets[text[i]];
+
+		int sum = 0;
+		for (int c = 0; c < alphabet; ++c)
+		{
+			sum += buckets[c];
+			buckets[c] = ends ? sum : sum - buckets[c];
+		}
+	}
+
+	static void induce(const int* text, int* suffixes, int n, const char* stype, int* buckets, int alphabet)
+	{
+		bucketBounds(text, n, buckets, alphabet, false);
+		for (int i = 0; i < n; ++i)
+		{
+			const int j = suffixes[i] - 1;
+			if (j >= 0 && !stype[j])
+				suffixes[buckets[text[j]]++] = j;
+		}
+
+		bucketBounds(text, n, buckets, alphabet, true);
+		for (int i = n - 1; i >= 0; --i)
+		{
+			const int j = suffixes[i] - 1;
+			if (j >= 0 && stype[j])
+				suffixes[--buckets[text[j]]] = j;
+		}
+	}
+};
+
+/// Block sorting codec: every block goes through the Burrows-Wheeler transform,
+/// move-to-front, a zero run stage and the Huffman coder. Blocks are independent and
+/// coded in parallel, one per worker, then written in order:
+///
+///   key | per block: u32 size | u32 primary index | u32 payload size | payload
+class BurrowsWheeler : public BaseCompression
+{
+	struct Block
+	{
+		std::vector<unsigned char> raw;
+		std::vector<unsigned char> payload;
+		std::uint32_t primary;
+	};
+
+	/// Per-thread scratch space and entropy coder.
+	class BlockCoder
+	{
+	public:
+		BlockCoder(BaseCompression::PrivateKeyType key) : entropy(key), input(&inputBuffer), output(&outputBuffer)
+		{
+			entropy.setThreads(1);
+		}
+
+		int encode(Block& block)
+		{
+			const int n = static_cast<int>(block.raw.size());
+			const unsigned char* data = block.raw.data();
+
+			// Bytes move up by one to make room for the sentinel.
+			text.resize(n + 1);
+			suffixes.resize(n + 1);
+			for (int i = 0; i < n; ++i)
+				text[i] = data[i] + 1;
+			text[n] = 0;
+
+			SuffixArray::build(text.data(), suffixes.data(), n + 1, 257, types, buckets);
+
+			// The sentinel's own row is left out of the last column and kept as the primary index.
+			transformed.resize(n);
+			for (int i = 0, j = 0; i <= n; ++i)
+			{
+				if (suffixes[i] == 0)
+					block.primary = static_cast<std::uint32_t>(i);
+				else
+					transformed[j++] = data[suffixes[i] - 1];
+			}
+
+			moveToFront(transformed);
+			encodeZeroRuns(transformed, symbols);
+
+			inputBuffer.attach(symbols.data(), symbols.size());
+			outputBuffer.attach(block.payload);
+			input.clear();
+			output.clear();
+			const int result = entropy.compressStream(input, output);
+			outputBuffer.detach();
+
+			return result;
+		}
+
+		int decode(Block& block)
+		{
+			inputBuffer.attach(block.payload.data(), block.payload.size());
+			outputBuffer.attach(symbols);
+			input.clear();
+			output.clear();
+			const int result = entropy.decompressStream(input, output);
+			outputBuffer.detach();
+
+			const size_t n = block.raw.size();
+			if (result != EXIT_SUCCESS || decodeZeroRuns(symbols, transformed) != EXIT_SUCCESS
+				|| transformed.size() != n || block.primary > n)
+				return EXIT_FAILURE;
+
+			undoMoveToFront(transformed);
+
+			// One packed entry per row, (next row << 8) | first byte of the row, so the
+			// walk costs a single random access per output byte.
+			std::uint32_t starts[256] = { 0 };
+			for (const auto c : transformed)
+				++starts[c];
+			for (std::uint32_t c = 0, sum = 1; c < 256; ++c)
+			{
+				const std::uint32_t count = starts[c];
+				starts[c] = sum;
+				sum += count;
+			}
+
+			rows.resize(n + 1);
+			rows[0] = block.primary << 8;
+			for (size_t i = 0; i <= n; ++i)
+			{
+				if (i == block.primary)
+					continue;
+
+				const unsigned char c = transformed[i < block.primary ? i : i - 1];
+				rows[starts[c]++] = static_cast<std::uint32_t>(i << 8) | c;
+			}
+
+			unsigned char* out = block.raw.data();
+			for (std::uint32_t i = 0, row = block.primary; i < n; ++i)
+			{
+				const std::uint32_t entry = rows[row];
+				out[i] = static_cast<unsigned char>(entry);
+				row = entry >> 8;
+			}
+
+			return EXIT_SUCCESS;
+		}
+
+	private:
+		// Symbols of the zero run stage: RunA and RunB are the bijective base 2 digits of a
+		// run of zeros, Escape precedes the rare values that do not fit after them.
+		enum Symbol
+		{
+			RunA,
+			RunB,
+			Escape = 255
+		};
+
+		Huffman entropy;
+		MemoryInputBuffer inputBuffer;
+		VectorOutputBuffer outputBuffer;
+		std::istream input;
+		std::ostream output;
+
+		std::vector<int> text;
+		std::vector<int> suffixes;
+		std::vector<char> types;
+		std::vector<int> buckets;
+		std::vector<unsigned char> transformed;
+		std::vector<unsigned char> symbols;
+		std::vector<std::uint32_t> rows;
+
+		static void moveToFront(std::vector<unsigned char>& data)
+		{
+			unsigned char order[256];
+			for (int i = 0; i < 256; ++i)
+				order[i] = static_cast<unsigned char>(i);
+
+			for (auto& c : data)
+			{
+				const unsigned char value = c;
+				unsigned char index = 0;
+				while (order[index] != value)
+					++index;
+
+				std::memmove(order + 1, order, index);
+				order[0] = value;
+				c = index;
+			}
+		}
+
+		static void undoMoveToFront(std::vector<unsigned char>& data)
+		{
+			unsigned char order[256];
+			for (int i = 0; i < 256; ++i)
+				order[i] = static_cast<unsigned char>(i);
+
+			for (auto& c : data)
+			{
+				const unsigned char index = c;
+				const unsigned char value = order[index];
+
+				std::memmove(order + 1, order, index);
+				order[0] = value;
+				c = value;
+			}
+		}
+
+		static void encodeZeroRuns(const std::vector<unsigned char>& data, std::vector<unsigned char>& output)
+		{
+			output.clear();
+			size_t run = 0;
+
+			for (size_t i = 0; i <= data.size(); ++i)
+			{
+				if (i < data.size() && data[i] == 0)
+				{
+					++run;
+					continue;
+				}
+
+				for (; run > 0; run = (run - 1) / 2)
+				{
+					output.push_back(run & 1 ? RunA : RunB);
+					if (!(run & 1))
+						--run;
+				}
+
+				if (i == data.size())
+					break;
+
+				if (data[i] + 1 < Escape)
+					output.push_back(static_cast<unsigned char>(data[i] + 1));
+				else
+				{
+					output.push_back(Escape);
+					output.push_back(data[i]);
+				}
+			}
+		}
+
+		static int decodeZeroRuns(const std::vector<unsigned char>& data, std::vector<unsigned char>& output)
+		{
+			output.clear();
+			size_t run = 0;
+			size_t weight = 1;
+
+			for (size_t i = 0; i < data.size(); ++i)
+			{
+				const unsigned char symbol = data[i];
+				if (symbol == RunA || symbol == RunB)
+				{
+					run += symbol == RunA ? weight : 2 * weight;
+					weight *= 2;
+					continue;
+				}
+
+				output.insert(output.end(), run, 0);
+				run = 0;
+				weight = 1;
+
+				if (symbol != Escape)
+					output.push_back(static_cast<unsigned char>(symbol - 1));
+				else if (++i < data.size())
+					output.push_back(data[i]);
+				else
+					return EXIT_FAILURE;
+			}
+
+			output.insert(output.end(), run, 0);
+			return EXIT_SUCCESS;
+		}
+	};
+
+	// The packed rows of the inverse transform leave 24 bits for the row index.
+	static const size_t BlockSize = 1 << 20;
+	// The largest payload a block codes to, so a damaged size is refused before every
+	// block of a batch allocates it. A block is at most 2 * BlockSize symbols, and a
+	// Huffman code longer than 32 bits takes more symbols than that (Fibonacci(34)); the
+	// table is under 9 KB.
+	static const size_t MaxPayload = 2 * BlockSize * 4 + 16 * 1024;
+
+	BaseCompression::PrivateKeyType stageKey;
+	unsigned threads;
+	std::unique_ptr<WorkerPool<BlockCoder>> pool;
+	std::vector<Block> blocks;
+
+	/// Created on first use, so idle compressers do not hold one coder per thread.
+	WorkerPool<BlockCoder>& workers()
+	{
+		if (!pool)
+		{
+			const BaseCompression::PrivateKeyType key = stageKey;
+			pool.reset(new WorkerPool<BlockCoder>(threads, [key](unsigned)
+			{
+				return new BlockCoder(key);
+			}));
+			blocks.resize(pool->size());
+		}
+
+		return *pool;
+	}
+
+	template <class T>
+	static bool readValue(std::istream& is, T& value)
+	{
+		return static_cast<bool>(is.read(reinterpret_cast<char *>(&value), sizeof(value)));
+	}
+
+	template <class T>
+	static void writeValue(std::ostream& os, const T& value)
+	{
+		os.write(reinterpret_cast<const char *>(&value), sizeof(value));
+	}
+
+public:
+
+	int compressFile(const std::string& inputPath, const std::string& outputPath)
+	{
+		std::ifstream is(inputPath, std::ios_base::binary);
+		std::ofstream os(outputPath, std::ios_base::binary);
+
+		if (!is.is_open() || !os.is_open())
+			return EXIT_FAILURE;
+
+		return compressStream(is, os);
+	}
+
+	int compressStream(std::istream& is, std::ostream& os)
+	{
+		WorkerPool<BlockCoder>& pool = workers();
+		addHeader(os);
+
+		for (bool more = true; more;)
+		{
+			size_t filled = 0;
+			for (; filled < blocks.size(); ++filled)
+			{
+				Block& block = blocks[filled];
+				block.raw.resize(BlockSize);
+				is.read(reinterpret_cast<char *>(block.raw.data()), block.raw.size());
+				block.raw.resize(static_cast<size_t>(is.gcount()));
+
+				if (block.raw.empty())
+					break;
+			}
+
+			more = filled == blocks.size();
+
+			std::atomic<size_t> failures(0);
+			pool.run(filled, [&](BlockCoder& coder, size_t job)
+			{
+				if (coder.encode(blocks[job]) != EXIT_SUCCESS)
+					failures++;
+			});
+
+			if (failures > 0)
+				return EXIT_FAILURE;
+
+			for (size_t i = 0; i < filled; ++i)
+			{
+				const Block& block = blocks[i];
+				writeValue(os, static_cast<std::uint32_t>(block.raw.size()));
+				writeValue(os, block.primary);
+				writeValue(os, static_cast<std::uint32_t>(block.payload.size()));
+				os.write(reinterpret_cast<const char *>(block.payload.data()), block.payload.size());
+			}
+		}
+
+		return os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	int decompressFile(const std::string& inputPath, const std::string& outputPath)
+	{
+		std::ifstream is(inputPath, std::ios_base::binary);
+		std::ofstream os(outputPath, std::ios_base::binary);
+
+		if (!is.is_open() || !os.is_open())
+			return EXIT_FAILURE;
+
+		return decompressStream(is, os);
+	}
+
+	int decompressStream(std::istream& is, std::ostream& os)
+	{
+		if (!checkHeader(is))
+			return EXIT_FAILURE;
+
+		WorkerPool<BlockCoder>& pool = workers();
+
+		for (bool more = true; more;)
+		{
+			size_t filled = 0;
+			for (; filled < blocks.size(); ++filled)
+			{
+				Block& block = blocks[filled];
+				std::uint32_t size = 0;
+				std::uint32_t payloadSize = 0;
+
+				if (!readValue(is, size))
+				{
+					if (is.gcount() != 0)
+						return EXIT_FAILURE;
+					break;
+				}
+
+				if (!readValue(is, block.primary) || !readValue(is, payloadSize) || size > BlockSize
+					|| payloadSize > MaxPayload)
+					return EXIT_FAILURE;
+
+				block.raw.resize(size);
+				block.payload.resize(payloadSize);
+				if (!is.read(reinterpret_cast<char *>(block.payload.data()), payloadSize))
+					return EXIT_FAILURE;
+			}
+
+			more = filled == blocks.size();
+
+			std::atomic<size_t> failures(0);
+			pool.run(filled, [&](BlockCoder& coder, size_t job)
+			{
+				if (coder.decode(blocks[job]) != EXIT_SUCCESS)
+					failures++;
+			});
+
+			if (failures > 0)
+				return EXIT_FAILURE;
+
+			for (size_t i = 0; i < filled; ++i)
+				os.write(reinterpret_cast<const char *>(blocks[i].raw.data()), blocks[i].raw.size());
+		}
+
+		return os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/// Blocks coded at once, one per thread; 0 means one per hardware thread.
+	void setThreads(unsigned count)
+	{
+		threads = count == 0 ? std::max(1u, std::thread::hardware_concurrency()) : count;
+		pool.reset();
+	}
+
+	BurrowsWheeler(BaseCompression::PrivateKeyType key) : BaseCompression(key), stageKey(key)
+	{
+		setThreads(0);
+	};
+};
\ No newline at end of file
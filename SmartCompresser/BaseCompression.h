@@ -0,0 +1,31 @@
+#pragma once
+
+#include "stdafx.h"
+
+/// Common base of the codecs. Every stream a codec writes starts with its key byte,
+/// which is how SmartCompresser tells the formats apart when decompressing.
+class BaseCompression
+{
+public:
+	typedef char PrivateKeyType;
+
+	explicit BaseCompression(PrivateKeyType key) : key(key)
+	{
+	}
+
+protected:
+	void addHeader(std::ostream& os) const
+	{
+		os.put(key);
+	}
+
+	/// Consumes the key byte, false when the stream does not start with this codec's key.
+	bool checkHeader(std::istream& is) const
+	{
+		char data;
+		return is.get(data) && data == key;
+	}
+
+private:
+	PrivateKeyType key;
+};
\ No newline at end of file
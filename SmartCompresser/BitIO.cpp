@@ -0,0 +1,477 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MemoryStream.cpp"
+#include "CpuFeatures.cpp"
+
+/// Length of the run of value at the start of data, at most size.
+inline size_t scanRunScalar(const unsigned char* data, size_t size, unsigned char value)
+{
+	size_t i = 0;
+	while (i < size && data[i] == value)
+		++i;
+
+	return i;
+}
+
+#ifdef CPU_DISPATCH
+CPU_TARGET_SSE42 inline size_t scanRunSse42(const unsigned char* data, size_t size, unsigned char value)
+{
+	const __m128i pattern = _mm_set1_epi8(static_cast<char>(value));
+	size_t i = 0;
+
+	for (; i + 16 <= size; i += 16)
+	{
+		const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		const unsigned equal = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, pattern)));
+		if (equal != 0xFFFF)
+			return i + CpuFeatures::trailingZeros(~equal);
+	}
+
+	return i + scanRunScalar(data + i, size - i, value);
+}
+
+CPU_TARGET_AVX2 inline size_t scanRunAvx2(const unsigned char* data, size_t size, unsigned char value)
+{
+	const __m256i pattern = _mm256_set1_epi8(static_cast<char>(value));
+	size_t i = 0;
+
+	for (; i + 32 <= size; i += 32)
+	{
+		const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+		const unsigned equal = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, pattern)));
+		if (equal != 0xFFFFFFFF)
+			return i + CpuFeatures::trailingZeros(~equal);
+	}
+
+	return i + scanRunScalar(data + i, size - i, value);
+}
+
+#ifdef CPU_DISPATCH_AVX512
+CPU_TARGET_AVX512 inline size_t scanRunAvx512(const unsigned char* data, size_t size, unsigned char value)
+{
+	const __m512i pattern = _mm512_set1_epi8(static_cast<char>(value));
+	size_t i = 0;
+
+	for (; i + 64 <= size; i += 64)
+	{
+		const __m512i bytes = _mm512_loadu_si512(data + i);
+		const std::uint64_t different = ~static_cast<std::uint64_t>(_mm512_cmpeq_epi8_mask(bytes, pattern));
+		if (different != 0)
+			return i + CpuFeatures::trailingZeros(different);
+	}
+
+	return i + scanRunScalar(data + i, size - i, value);
+}
+#endif
+#endif
+
+inline size_t scanRun(const unsigned char* data, size_t size, unsigned char value)
+{
+	// Most runs end within a few bytes, not worth setting up a vector for.
+	const size_t head = std::min(size, static_cast<size_t>(8));
+	const size_t found = scanRunScalar(data, head, value);
+	if (found < head)
+		return found;
+
+	data += found;
+	size -= found;
+
+#ifdef CPU_DISPATCH
+#ifdef CPU_DISPATCH_AVX512
+	if (cpuLevel >= CpuFeatures::Avx512)
+		return found + scanRunAvx512(data, size, value);
+#endif
+	if (cpuLevel >= CpuFeatures::Avx2)
+		return found + scanRunAvx2(data, size, value);
+	if (cpuLevel >= CpuFeatures::Sse42)
+		return found + scanRunSse42(data, size, value);
+#endif
+	return found + scanRunScalar(data, size, value);
+}
+
+/// Byte sources and sinks the codec kernels are templated on. Each kernel is compiled
+/// once per source/sink pair, so reading or writing a byte inlines to a pointer bump
+/// and a bounds check. runKernel picks the pair once per call.
+
+/// Buffered reads from any stream, through caller owned scratch space. It reads ahead,
+/// so it is meant for codecs that consume their input to the end.
+class StreamSource
+{
+public:
+	StreamSource(std::istream& is, std::vector<unsigned char>& buffer) : is(is), buffer(buffer), position(nullptr), end(nullptr)
+	{
+		buffer.resize(BufferSize);
+	}
+
+	bool get(unsigned char& value)
+	{
+		if (position == end && !fill())
+			return false;
+
+		value = *position++;
+		return true;
+	}
+
+	/// Consumes up to limit more bytes equal to value, returns how many.
+	size_t run(unsigned char value, size_t limit)
+	{
+		size_t count = 0;
+		while (count < limit && (position != end || fill()))
+		{
+			const size_t available = std::min(limit - count, static_cast<size_t>(end - position));
+			const size_t found = scanRun(position, available, value);
+
+			position += found;
+			count += found;
+			if (found < available)
+				break;
+		}
+
+		return count;
+	}
+
+	/// Consumes up to limit bytes as one span: what is buffered, then the rest read
+	/// straight into block. Returns the size, 0 at the end of the input.
+	size_t take(size_t limit, std::vector<unsigned char>& block, const unsigned char*& data)
+	{
+		block.resize(limit);
+		size_t count = std::min(limit, static_cast<size_t>(end - position));
+		std::copy(position, position + count, block.begin());
+		position += count;
+
+		if (count < limit)
+		{
+			is.read(reinterpret_cast<char *>(block.data() + count), limit - count);
+			count += static_cast<size_t>(is.gcount());
+		}
+
+		data = block.data();
+		return count;
+	}
+
+private:
+	static const size_t BufferSize = 64 * 1024;
+
+	std::istream& is;
+	std::vector<unsigned char>& buffer;
+	const unsigned char* position;
+	const unsigned char* end;
+
+	bool fill()
+	{
+		is.read(reinterpret_cast<char *>(buffer.data()), buffer.size());
+		position = buffer.data();
+		end = position + is.gcount();
+
+		return position != end;
+	}
+};
+
+/// Reads memory in place: in-memory buffers and mapped files.
+class MemorySource
+{
+public:
+	MemorySource(const unsigned char* data, size_t size) : begin(data), position(data), end(data + size)
+	{
+	}
+
+	bool get(unsigned char& value)
+	{
+		if (position == end)
+			return false;
+
+		value = *position++;
+		return true;
+	}
+
+	size_t run(unsigned char value, size_t limit)
+	{
+		const size_t found = scanRun(position, std::min(limit, static_cast<size_t>(end - position)), value);
+		position += found;
+		return found;
+	}
+
+	/// The span is the memory itself, block stays untouched.
+	size_t take(size_t limit, std::vector<unsigned char>&, const unsigned char*& data)
+	{
+		const size_t count = std::min(limit, static_cast<size_t>(end - position));
+		data = position;
+		position += count;
+		return count;
+	}
+
+	size_t consumed() const
+	{
+		return static_cast<size_t>(position - begin);
+	}
+
+private:
+	const unsigned char* begin;
+	const unsigned char* position;
+	const unsigned char* end;
+};
+
+/// Buffered writes to any stream; flush() before the stream is used again.
+class StreamSink
+{
+public:
+	StreamSink(std::ostream& os, std::vector<unsigned char>& buffer) : os(os), buffer(buffer), position(0)
+	{
+		buffer.resize(BufferSize);
+	}
+
+	void put(unsigned char value)
+	{
+		if (position == BufferSize)
+			flush();
+
+		buffer[position++] = value;
+	}
+
+	void put(unsigned char value, size_t count)
+	{
+		while (count > 0)
+		{
+			if (position == BufferSize)
+				flush();
+
+			const size_t run = std::min(count, BufferSize - position);
+			std::fill(buffer.begin() + position, buffer.begin() + position + run, value);
+			position += run;
+			count -= run;
+		}
+	}
+
+	/// Large spans skip the buffer.
+	void write(const unsigned char* data, size_t count)
+	{
+		if (count > BufferSize - position)
+		{
+			flush();
+			if (count >= BufferSize)
+			{
+				os.write(reinterpret_cast<const char *>(data), count);
+				return;
+			}
+		}
+
+		std::copy(data, data + count, buffer.begin() + position);
+		position += count;
+	}
+
+	void flush()
+	{
+		os.write(reinterpret_cast<const char *>(buffer.data()), position);
+		position = 0;
+	}
+
+private:
+	static const size_t BufferSize = 64 * 1024;
+
+	std::ostream& os;
+	std::vector<unsigned char>& buffer;
+	size_t position;
+};
+
+/// Appends to a vector, for codecs that assemble a block in memory.
+class VectorSink
+{
+public:
+	explicit VectorSink(std::vector<unsigned char>& output) : output(output)
+	{
+	}
+
+	void put(unsigned char value)
+	{
+		output.push_back(value);
+	}
+
+	void put(unsigned char value, size_t count)
+	{
+		output.insert(output.end(), count, value);
+	}
+
+	void write(const unsigned char* data, size_t count)
+	{
+		output.insert(output.end(), data, data + count);
+	}
+
+	void flush()
+	{
+	}
+
+private:
+	std::vector<unsigned char>& output;
+};
+
+/// Counts and drops, for decoding that only verifies.
+class NullSink
+{
+public:
+	explicit NullSink(NullOutputBuffer& target) : target(target), count(0)
+	{
+	}
+
+	void put(unsigned char)
+	{
+		++count;
+	}
+
+	void put(unsigned char, size_t run)
+	{
+		count += run;
+	}
+
+	void write(const unsigned char*, size_t size)
+	{
+		count += size;
+	}
+
+	void flush()
+	{
+		target.discard(count);
+		count = 0;
+	}
+
+private:
+	NullOutputBuffer& target;
+	std::uint64_t count;
+};
+
+/// Most significant bit first, through a 64 bit accumulator.
+template <class Sink>
+class BitWriter
+{
+public:
+	explicit BitWriter(Sink& sink) : sink(sink), accumulator(0), bits(0)
+	{
+	}
+
+	/// Up to 32 bits; value has to fit in count.
+	void write(std::uint32_t value, int count)
+	{
+		accumulator = (accumulator << count) | value;
+		for (bits += count; bits >= 8; bits -= 8)
+			sink.put(static_cast<unsigned char>(accumulator >> (bits - 8)));
+	}
+
+	/// Pads the last byte with zeros.
+	void flush()
+	{
+		if (bits > 0)
+			sink.put(static_cast<unsigned char>(accumulator << (8 - bits)));
+
+		accumulator = 0;
+		bits = 0;
+	}
+
+private:
+	Sink& sink;
+	std::uint64_t accumulator;
+	int bits;
+};
+
+template <class Source>
+class BitReader
+{
+public:
+	explicit BitReader(Source& source) : source(source), accumulator(0), bits(0)
+	{
+	}
+
+	/// Up to 32 bits, false once the input runs out.
+	bool read(int count, std::uint32_t& value)
+	{
+		if (bits < count)
+		{
+			refill();
+			if (bits < count)
+				return false;
+		}
+
+		bits -= count;
+		value = static_cast<std::uint32_t>((accumulator >> bits) & mask(count));
+		return true;
+	}
+
+	/// The next count bits (up to 32) without consuming them, zero padded past the end.
+	std::uint32_t peek(int count)
+	{
+		if (bits < count)
+			refill();
+
+		if (bits >= count)
+			return static_cast<std::uint32_t>((accumulator >> (bits - count)) & mask(count));
+
+		return static_cast<std::uint32_t>((accumulator << (count - bits)) & mask(count));
+	}
+
+	/// Consumes bits seen by peek, false if they ran past the end.
+	bool skip(int count)
+	{
+		if (count > bits)
+			return false;
+
+		bits -= count;
+		return true;
+	}
+
+private:
+	Source& source;
+	std::uint64_t accumulator;
+	int bits;
+
+	void refill()
+	{
+		unsigned char value;
+		while (bits <= 56 && source.get(value))
+		{
+			accumulator = (accumulator << 8) | value;
+			bits += 8;
+		}
+	}
+
+	static std::uint64_t mask(int count)
+	{
+		return (std::uint64_t(1) << count) - 1;
+	}
+};
+
+/// Runs kernel(source, sink) with sink over os: counted only for a NullOutputBuffer,
+/// buffered otherwise.
+template <class Source, class Kernel>
+int runKernelInto(Source& source, std::ostream& os, std::vector<unsigned char>& outputScratch, const Kernel& kernel)
+{
+	if (NullOutputBuffer* discard = dynamic_cast<NullOutputBuffer*>(os.rdbuf()))
+	{
+		NullSink sink(*discard);
+		const int result = kernel(source, sink);
+		sink.flush();
+		return result;
+	}
+
+	StreamSink sink(os, outputScratch);
+	const int result = kernel(source, sink);
+	sink.flush();
+	return result;
+}
+
+/// Runs kernel(source, sink) with the cheapest policies the streams allow. Memory input
+/// (buffers and mapped files) is read in place and the stream moved past what the
+/// kernel took; other streams are buffered through the scratch vectors.
+template <class Kernel>
+int runKernel(std::istream& is, std::ostream& os, std::vector<unsigned char>& inputScratch,
+	std::vector<unsigned char>& outputScratch, const Kernel& kernel)
+{
+	if (MemoryInputBuffer* memory = dynamic_cast<MemoryInputBuffer*>(is.rdbuf()))
+	{
+		MemorySource source(memory->current(), memory->remaining());
+		const int result = runKernelInto(source, os, outputScratch, kernel);
+		memory->skip(source.consumed());
+		return result;
+	}
+
+	StreamSource source(is, inputScratch);
+	return runKernelInto(source, os, outputScratch, kernel);
+}
\ No newline at end of file
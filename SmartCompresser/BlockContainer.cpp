@@ -0,0 +1,256 @@
+#pragma once
+
+#include "stdafx.h"
+
+/// Index of a block container, the format written by APPEND. The input is cut in
+/// fixed size blocks, each compressed on its own (key byte included). Every append
+/// writes its blocks and then one index segment listing only those blocks, which
+/// points back to the segment of the append before; the footer points at the newest:
+///
+///   key | blocks | segment | blocks | segment | ... | newest segment offset (u64) | "SCB3"
+///   segment: u32 count | entries | previous segment offset (u64, 0 for the first)
+///
+/// Containers with checksums end in "SCB4" instead; their entries carry the CRC32C of
+/// the raw block and every segment ends in the CRC32C of all the raw data so far.
+/// Nothing before the old footer is written again, so until the new footer is out the
+/// file still holds the old container, which a failed append restores by repeating
+/// the old footer. Containers from before the segments ("SCB1", "SCB2") have one index
+/// without a back pointer; they are still read, and their next append lists every block.
+class BlockContainer
+{
+public:
+	static const size_t BlockSize = 1 << 22;
+
+	struct Block
+	{
+		std::uint64_t rawSize;
+		std::uint64_t offset;         // from the start of the container
+		std::uint64_t compressedSize;
+		char codec;                   // key byte of the block
+		std::uint32_t checksum;       // of the raw block, 0 without checksums
+	};
+
+	BlockContainer() : nextOffset(1), lastSegment(0), listed(0), checksums(false), streamChecksum(0)
+	{
+	}
+
+	bool hasChecksums() const
+	{
+		return checksums;
+	}
+
+	/// Only for a container that has no blocks yet.
+	void enableChecksums()
+	{
+		checksums = true;
+	}
+
+	/// Checksum of the raw data of all blocks, continued as blocks are appended.
+	std::uint32_t getStreamChecksum() const
+	{
+		return streamChecksum;
+	}
+
+	void setStreamChecksum(std::uint32_t checksum)
+	{
+		streamChecksum = checksum;
+	}
+
+	const std::vector<Block>& getBlocks() const
+	{
+		return blocks;
+	}
+
+	/// Where the next block goes.
+	std::uint64_t getAppendOffset() const
+	{
+		return nextOffset;
+	}
+
+	std::uint64_t rawSize() const
+	{
+		std::uint64_t size = 0;
+		for (const auto& block : blocks)
+			size += block.rawSize;
+
+		return size;
+	}
+
+	void addBlock(std::uint64_t rawSize, std::uint64_t compressedSize, char codec, std::uint32_t checksum)
+	{
+		Block block;
+		block.rawSize = rawSize;
+		block.offset = nextOffset;
+		block.compressedSize = compressedSize;
+		block.codec = codec;
+		block.checksum = checksums ? checksum : 0;
+
+		blocks.push_back(block);
+		nextOffset += compressedSize;
+	}
+
+	/// Reads the footer and follows the segments back to the first, the stream is left anywhere.
+	int read(std::istream& is)
+	{
+		blocks.clear();
+		listed = 0;
+
+		char magic[MagicSize];
+		is.seekg(-static_cast<std::streamoff>(sizeof(lastSegment) + MagicSize), std::ios::end);
+		const std::streampos footer = is.tellg();
+		is.read(reinterpret_cast<char *>(&lastSegment), sizeof(lastSegment));
+		is.read(magic, MagicSize);
+
+		const bool legacy = std::equal(magic, magic + MagicSize, LegacyMagic())
+			|| std::equal(magic, magic + MagicSize, LegacyChecksumMagic());
+		checksums = std::equal(magic, magic + MagicSize, ChecksumMagic())
+			|| std::equal(magic, magic + MagicSize, LegacyChecksumMagic());
+		streamChecksum = 0;
+
+		if (!is || footer == std::streampos(-1)
+			|| !(legacy || checksums || std::equal(magic, magic + MagicSize, Magic())))
+			return EXIT_FAILURE;
+
+		// Appending goes on after the footer.
+		nextOffset = static_cast<std::uint64_t>(footer) + sizeof(lastSegment) + MagicSize;
+
+		// Segments come newest first; each one has to start before the one after it, so
+		// a damaged back pointer cannot loop.
+		std::vector<std::vector<Block>> segments;
+		std::uint64_t end = static_cast<std::uint64_t>(footer);
+		bool newest = true;
+
+		for (std::uint64_t segment = lastSegment; segment != 0;)
+		{
+			std::uint32_t count = 0;
+			std::uint64_t previous = 0;
+
+			if (segment >= end)
+				return EXIT_FAILURE;
+
+			is.seekg(static_cast<std::streamoff>(segment), std::ios::beg);
+			is.read(reinterpret_cast<char *>(&count), sizeof(count));
+			if (!is || count > (end - segment) / entrySize())
+				return EXIT_FAILURE;
+
+			segments.push_back(std::vector<Block>(count));
+			for (auto& block : segments.back())
+			{
+				is.read(reinterpret_cast<char *>(&block.rawSize), sizeof(block.rawSize));
+				is.read(reinterpret_cast<char *>(&block.offset), sizeof(block.offset));
+				is.read(reinterpret_cast<char *>(&block.compressedSize), sizeof(block.compressedSize));
+				is.get(block.codec);
+
+				block.checksum = 0;
+				if (checksums)
+					is.read(reinterpret_cast<char *>(&block.checksum), sizeof(block.checksum));
+
+				// Blocks are written before the segment listing them, readers size their buffers by this.
+				if (block.offset == 0 || block.offset > segment || block.compressedSize > segment - block.offset)
+					return EXIT_FAILURE;
+			}
+
+			if (!legacy)
+				is.read(reinterpret_cast<char *>(&previous), sizeof(previous));
+
+			std::uint32_t checksum = 0;
+			if (checksums)
+				is.read(reinterpret_cast<char *>(&checksum), sizeof(checksum));
+
+			if (!is)
+				return EXIT_FAILURE;
+
+			if (newest)
+				streamChecksum = checksum;
+
+			newest = false;
+			end = segment;
+			segment = previous;
+		}
+
+		for (auto segment = segments.rbegin(); segment != segments.rend(); ++segment)
+			blocks.insert(blocks.end(), segment->begin(), segment->end());
+
+		// The old index has no back pointer, so the next segment starts a new chain.
+		if (legacy)
+			lastSegment = 0;
+		else
+			listed = blocks.size();
+
+		return EXIT_SUCCESS;
+	}
+
+	/// Writes a segment with the blocks added since the last one, then the footer, at the
+	/// current position, which must be getAppendOffset().
+	int write(std::ostream& os)
+	{
+		const std::uint32_t count = static_cast<std::uint32_t>(blocks.size() - listed);
+
+		os.write(reinterpret_cast<const char *>(&count), sizeof(count));
+		for (size_t i = listed; i < blocks.size(); ++i)
+		{
+			const Block& block = blocks[i];
+			os.write(reinterpret_cast<const char *>(&block.rawSize), sizeof(block.rawSize));
+			os.write(reinterpret_cast<const char *>(&block.offset), sizeof(block.offset));
+			os.write(reinterpret_cast<const char *>(&block.compressedSize), sizeof(block.compressedSize));
+			os.put(block.codec);
+
+			if (checksums)
+				os.write(reinterpret_cast<const char *>(&block.checksum), sizeof(block.checksum));
+		}
+
+		os.write(reinterpret_cast<const char *>(&lastSegment), sizeof(lastSegment));
+		if (checksums)
+			os.write(reinterpret_cast<const char *>(&streamChecksum), sizeof(streamChecksum));
+
+		// The file only ends in the new footer once the segment it points at is out.
+		os.flush();
+		lastSegment = nextOffset;
+		listed = blocks.size();
+		return writeFooter(os);
+	}
+
+	/// Writes the footer alone at the current position, pointing at the newest segment.
+	int writeFooter(std::ostream& os) const
+	{
+		os.write(reinterpret_cast<const char *>(&lastSegment), sizeof(lastSegment));
+		os.write(checksums ? ChecksumMagic() : Magic(), MagicSize);
+
+		return os.flush() ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+private:
+	static const size_t MagicSize = 4;
+
+	std::vector<Block> blocks;
+	std::uint64_t nextOffset;
+	std::uint64_t lastSegment; // 0 before the first segment
+	size_t listed;             // blocks already in a segment
+	bool checksums;
+	std::uint32_t streamChecksum;
+
+	size_t entrySize() const
+	{
+		return 3 * sizeof(std::uint64_t) + 1 + (checksums ? sizeof(std::uint32_t) : 0);
+	}
+
+	static const char* Magic()
+	{
+		return "SCB3";
+	}
+
+	static const char* ChecksumMagic()
+	{
+		return "SCB4";
+	}
+
+	static const char* LegacyMagic()
+	{
+		return "SCB1";
+	}
+
+	static const char* LegacyChecksumMagic()
+	{
+		return "SCB2";
+	}
+};
\ No newline at end of file
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "stdafx.h"
+#include <cstring>
+#include "CpuFeatures.cpp"
+
+/// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the processor has it
+/// and slicing by 8 tables otherwise; both give the same values. update() continues
+/// from a previous result, so a checksum can be computed piece by piece.
+class Crc32c
+{
+public:
+	Crc32c() : hardware(false)
+	{
+		for (std::uint32_t i = 0; i < 256; ++i)
+		{
+			std::uint32_t crc = i;
+			for (int bit = 0; bit < 8; ++bit)
+				crc = (crc >> 1) ^ (Polynomial & (0u - (crc & 1)));
+			table[0][i] = crc;
+		}
+
+		for (std::uint32_t i = 0; i < 256; ++i)
+		for (int slice = 1; slice < Slices; ++slice)
+			table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+
+		hardware = cpuLevel >= CpuFeatures::Sse42;
+	}
+
+	std::uint32_t update(std::uint32_t crc, const unsigned char* data, size_t size) const
+	{
+#ifdef CPU_DISPATCH
+		if (hardware)
+			return ~updateHardware(~crc, data, size);
+#endif
+		return ~updateSoftware(~crc, data, size);
+	}
+
+	/// Checksum of A followed by B from the checksums of A and B and the length of B,
+	/// without the data (zlib's crc32_combine with the Castagnoli polynomial).
+	static std::uint32_t combine(std::uint32_t first, std::uint32_t second, std::uint64_t secondLength)
+	{
+		if (secondLength == 0)
+			return first;
+
+		// Operator for one zero bit, then squared into the operators for 2 and 4 bits.
+		std::uint32_t odd[32];
+		std::uint32_t even[32];
+		odd[0] = Polynomial;
+		for (int n = 1; n < 32; ++n)
+			odd[n] = 1u << (n - 1);
+
+		square(even, odd);
+		square(odd, even);
+
+		// Applies the operators for 8, 16, 32 ... zero bits as the bits of the length ask.
+		for (;;)
+		{
+			square(even, odd);
+			if (secondLength & 1)
+				first = times(even, first);
+			secondLength >>= 1;
+			if (secondLength == 0)
+				break;
+
+			square(odd, even);
+			if (secondLength & 1)
+				first = times(odd, first);
+			secondLength >>= 1;
+			if (secondLength == 0)
+				break;
+		}
+
+		return first ^ second;
+	}
+
+	bool usesHardware() const
+	{
+		return hardware;
+	}
+
+private:
+	static const std::uint32_t Polynomial = 0x82F63B78; // reflected 0x1EDC6F41
+	static const int Slices = 8;
+
+	std::uint32_t table[Slices][256];
+	bool hardware;
+
+	static std::uint32_t times(const std::uint32_t(&matrix)[32], std::uint32_t vector)
+	{
+		std::uint32_t sum = 0;
+		for (int i = 0; vector != 0; ++i, vector >>= 1)
+		{
+			if (vector & 1)
+				sum ^= matrix[i];
+		}
+
+		return sum;
+	}
+
+	static void square(std::uint32_t(&result)[32], const std::uint32_t(&matrix)[32])
+	{
+		for (int n = 0; n < 32; ++n)
+			result[n] = times(matrix, matrix[n]);
+	}
+
+	std::uint32_t updateSoftware(std::uint32_t crc, const unsigned char* data, size_t size) const
+	{
+		for (; size >= Slices; size -= Slices, data += Slices)
+		{
+			const std::uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | static_cast<std::uint32_t>(data[3]) << 24);
+			crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+				^ table[3][data[4]] ^ table[2][data[5]] ^ table[1][data[6]] ^ table[0][data[7]];
+		}
+
+		for (; size > 0; --size)
+			crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF];
+
+		return crc;
+	}
+
+#ifdef CPU_DISPATCH
+	CPU_TARGET_SSE42 static std::uint32_t updateHardware(std::uint32_t crc, const unsigned char* data, size_t size)
+	{
+#if defined(_M_X64) || defined(__x86_64__)
+		std::uint64_t wide = crc;
+		for (; size >= 8; size -= 8, data += 8)
+		{
+			std::uint64_t word;
+			std::memcpy(&word, data, sizeof(word));
+			wide = _mm_crc32_u64(wide, word);
+		}
+		crc = static_cast<std::uint32_t>(wide);
+#endif
+		for (; size >= 4; size -= 4, data += 4)
+		{
+			std::uint32_t word;
+			std::memcpy(&word, data, sizeof(word));
+			crc = _mm_crc32_u32(crc, word);
+		}
+
+		for (; size > 0; --size)
+			crc = _mm_crc32_u8(crc, *data++);
+
+		return crc;
+	}
+#endif
+};
\ No newline at end of file
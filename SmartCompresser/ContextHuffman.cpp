@@ -0,0 +1,459 @@
+#pragma once
+
+#include "stdafx.h"
+#include "BaseCompression.h"
+#include "BitIO.cpp"
+#include <functional>
+
+/// Order-1 Huffman: every previous byte selects its own canonical code, so a byte costs
+/// what it costs after the one before it. Codes are at most MaxCodeLength bits, which
+/// lets decoding take one table lookup per byte. Only the code lengths are stored:
+///
+///   key | u64 length | used contexts (256 bit map)
+///       | per used context: used symbols (256 bit map) | 4 bit code length per used symbol
+///       | code bits, most significant first
+///
+/// The input is read twice, so it has to be seekable.
+class ContextHuffman : public BaseCompression
+{
+	static const int Symbols = 256;
+	static const int MaxCodeLength = 11;
+	static const size_t ChunkSize = 1 << 16;
+
+	std::vector<std::uint64_t> counts;     // [context][symbol]
+	std::vector<unsigned char> lengths;    // [context][symbol]
+	std::vector<std::uint16_t> codes;      // [context][symbol]
+	std::vector<std::uint16_t> decodeTable; // [context][next MaxCodeLength bits] = symbol << 4 | length
+	std::vector<unsigned char> tableLengths; // [context][symbol] the decode table was built from
+	std::vector<unsigned char> chunk;
+	std::vector<unsigned char> inputScratch;
+	std::vector<unsigned char> outputScratch;
+
+	/// Huffman code lengths of one context, flattened by halving the counts until the
+	/// longest code fits in limit bits.
+	static void codeLengths(const std::uint64_t* symbolCounts, unsigned char* result, int limit)
+	{
+		typedef std::pair<std::uint64_t, int> Node;
+		std::uint64_t weights[Symbols];
+		std::copy(symbolCounts, symbolCounts + Symbols, weights);
+
+		// Runs for every context, so the heap lives on the stack instead of in a priority_queue.
+		const std::greater<Node> comparator = std::greater<Node>();
+		Node heap[Symbols];
+
+		for (;;)
+		{
+			int parent[2 * Symbols];
+			int depth[2 * Symbols];
+			Node* heapEnd = heap;
+
+			for (int s = 0; s < Symbols; ++s)
+			{
+				result[s] = 0;
+				if (weights[s] > 0)
+				{
+					*heapEnd++ = Node(weights[s], s);
+					std::push_heap(heap, heapEnd, comparator);
+				}
+			}
+
+			if (heapEnd - heap == 1)
+			{
+				result[heap[0].second] = 1;
+				return;
+			}
+
+			int next = Symbols;
+			while (heapEnd - heap > 1)
+			{
+				std::pop_heap(heap, heapEnd--, comparator);
+				const Node first = *heapEnd;
+				std::pop_heap(heap, heapEnd--, comparator);
+				const Node second = *heapEnd;
+
+				parent[first.second] = next;
+				parent[second.second] = next;
+				*heapEnd++ = Node(first.first + second.first, next++);
+				std::push_heap(heap, heapEnd, comparator);
+			}
+
+			// Parents are created after their children, so depths resolve from the root down.
+			int longest = 0;
+			depth[next - 1] = 0;
+			for (int node = next - 2; node >= Symbols; --node)
+				depth[node] = depth[parent[node]] + 1;
+
+			for (int s = 0; s < Symbols; ++s)
+			{
+				if (weights[s] > 0)
+				{
+					result[s] = static_cast<unsigned char>(depth[parent[s]] + 1);
+					longest = std::max(longest, static_cast<int>(result[s]));
+				}
+			}
+
+			if (longest <= limit)
+				return;
+
+			for (auto& weight : weights)
+			{
+				if (weight > 0)
+					weight = (weight + 1) / 2;
+			}
+		}
+	}
+
+	/// Canonical codes: shorter codes first, equal lengths in symbol order.
+	static void canonicalCodes(const unsigned char* codeLengths, std::uint16_t* result)
+	{
+		int lengthCount[MaxCodeLength + 1] = { 0 };
+		for (int s = 0; s < Symbols; ++s)
+			++lengthCount[codeLengths[s]];
+
+		std::uint16_t nextCode[MaxCodeLength + 1] = { 0 };
+		lengthCount[0] = 0;
+		for (int length = 1, code = 0; length <= MaxCodeLength; ++length)
+		{
+			code = (code + lengthCount[length - 1]) << 1;
+			nextCode[length] = static_cast<std::uint16_t>(code);
+		}
+
+		for (int s = 0; s < Symbols; ++s)
+		{
+			if (codeLengths[s] > 0)
+				result[s] = nextCode[codeLengths[s]]++;
+		}
+	}
+
+	static bool used(const unsigned char* map, int index)
+	{
+		return (map[index >> 3] >> (index & 7)) & 1;
+	}
+
+	static void markUsed(unsigned char* map, int index)
+	{
+		map[index >> 3] |= static_cast<unsigned char>(1 << (index & 7));
+	}
+
+	void writeTables(std::ostream& os)
+	{
+		unsigned char contextMap[Symbols / 8] = { 0 };
+		for (int context = 0; context < Symbols; ++context)
+		{
+			const unsigned char* contextLengths = &lengths[context * Symbols];
+			if (std::any_of(contextLengths, contextLengths + Symbols, [](unsigned char length) { return length > 0; }))
+				markUsed(contextMap, context);
+		}
+		os.write(reinterpret_cast<const char *>(contextMap), sizeof(contextMap));
+
+		for (int context = 0; context < Symbols; ++context)
+		{
+			if (!used(contextMap, context))
+				continue;
+
+			const unsigned char* contextLengths = &lengths[context * Symbols];
+			unsigned char symbolMap[Symbols / 8] = { 0 };
+			unsigned char nibbles[Symbols];
+			size_t nibbleCount = 0;
+
+			for (int s = 0; s < Symbols; ++s)
+			{
+				if (contextLengths[s] == 0)
+					continue;
+
+				markUsed(symbolMap, s);
+				nibbles[nibbleCount++] = contextLengths[s];
+			}
+
+			os.write(reinterpret_cast<const char *>(symbolMap), sizeof(symbolMap));
+			for (size_t i = 0; i < nibbleCount; i += 2)
+				os.put(static_cast<char>(nibbles[i] << 4 | (i + 1 < nibbleCount ? nibbles[i + 1] : 0)));
+		}
+	}
+
+	int readTables(std::istream& is)
+	{
+		unsigned char contextMap[Symbols / 8];
+		if (!is.read(reinterpret_cast<char *>(contextMap), sizeof(contextMap)))
+			return EXIT_FAILURE;
+
+		lengths.assign(Symbols * Symbols, 0);
+		for (int context = 0; context < Symbols; ++context)
+		{
+			if (!used(contextMap, context))
+				continue;
+
+			unsigned char symbolMap[Symbols / 8];
+			if (!is.read(reinterpret_cast<char *>(symbolMap), sizeof(symbolMap)))
+				return EXIT_FAILURE;
+
+			unsigned char* contextLengths = &lengths[context * Symbols];
+			char packed = 0;
+			for (int s = 0, n = 0; s < Symbols; ++s)
+			{
+				if (!used(symbolMap, s))
+					continue;
+
+				if (n++ % 2 == 0 && !is.get(packed))
+					return EXIT_FAILURE;
+
+				contextLengths[s] = static_cast<unsigned char>(n % 2 == 1 ? (packed >> 4) & 0x0F : packed & 0x0F);
+				if (contextLengths[s] == 0 || contextLengths[s] > MaxCodeLength)
+					return EXIT_FAILURE;
+			}
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	/// Brings the decode table in line with lengths. Only the contexts whose codes changed
+	/// since the last call are rebuilt, so blocks sharing their statistics pay nothing.
+	void buildDecodeTables()
+	{
+		const size_t tableSize = size_t(1) << MaxCodeLength;
+		std::uint16_t contextCodes[Symbols];
+
+		decodeTable.resize(Symbols * tableSize);
+		tableLengths.resize(Symbols * Symbols);
+		for (int context = 0; context < Symbols; ++context)
+		{
+			const unsigned char* contextLengths = &lengths[context * Symbols];
+			unsigned char* builtLengths = &tableLengths[context * Symbols];
+			if (std::equal(contextLengths, contextLengths + Symbols, builtLengths))
+				continue;
+
+			std::copy(contextLengths, contextLengths + Symbols, builtLengths);
+			canonicalCodes(contextLengths, contextCodes);
+
+			std::uint16_t* table = &decodeTable[context * tableSize];
+			std::fill(table, table + tableSize, static_cast<std::uint16_t>(0));
+			for (int s = 0; s < Symbols; ++s)
+			{
+				const int length = contextLengths[s];
+				if (length == 0)
+					continue;
+
+				// Every bit pattern starting with the code maps to the symbol.
+				const size_t first = static_cast<size_t>(contextCodes[s]) << (MaxCodeLength - length);
+				const size_t last = first + (size_t(1) << (MaxCodeLength - length));
+				if (last > tableSize)
+					break;
+
+				std::fill(table + first, table + last, static_cast<std::uint16_t>(s << 4 | length));
+			}
+		}
+	}
+
+	/// First pass: order-1 counts, returns the input length.
+	template <class Source, class Sink>
+	int count(Source& source, Sink&, std::uint64_t& total)
+	{
+		unsigned char previous = 0;
+		const unsigned char* data;
+		size_t size;
+
+		counts.assign(Symbols * Symbols, 0);
+		total = 0;
+		while ((size = source.take(ChunkSize, chunk, data)) > 0)
+		{
+			for (size_t i = 0; i < size; ++i)
+			{
+				++counts[previous * Symbols + data[i]];
+				previous = data[i];
+			}
+			total += size;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	template <class Source, class Sink>
+	int encode(Source& source, Sink& sink)
+	{
+		std::uint64_t accumulator = 0;
+		int bits = 0;
+		unsigned char previous = 0;
+		const unsigned char* data;
+		size_t size;
+
+		while ((size = source.take(ChunkSize, chunk, data)) > 0)
+		{
+			for (size_t i = 0; i < size; ++i)
+			{
+				const size_t index = previous * Symbols + data[i];
+				accumulator = (accumulator << lengths[index]) | codes[index];
+				for (bits += lengths[index]; bits >= 8; bits -= 8)
+					sink.put(static_cast<unsigned char>(accumulator >> (bits - 8)));
+
+				previous = data[i];
+			}
+		}
+
+		if (bits > 0)
+			sink.put(static_cast<unsigned char>(accumulator << (8 - bits)));
+
+		return EXIT_SUCCESS;
+	}
+
+	template <class Source, class Sink>
+	int decode(Source& source, Sink& sink, std::uint64_t total) const
+	{
+		const size_t tableSize = size_t(1) << MaxCodeLength;
+		const std::uint64_t mask = tableSize - 1;
+		std::uint64_t accumulator = 0;
+		int bits = 0;
+		size_t padding = 0; // zero bytes fed past the end of the input
+		unsigned char previous = 0;
+		const std::uint16_t* tables = decodeTable.data();
+
+		while (total > 0)
+		{
+			// Codes may not run into the zeros added past the end of the input. Every pass
+			// decodes at least one code, so damaged input fails within a few passes.
+			if (padding * 8 > static_cast<size_t>(bits))
+				return EXIT_FAILURE;
+
+			// Keep at least one whole code in the accumulator.
+			for (unsigned char data; bits <= 56; bits += 8)
+			{
+				if (source.get(data))
+				{
+					accumulator = (accumulator << 8) | data;
+				}
+				else
+				{
+					accumulator <<= 8;
+					++padding;
+				}
+			}
+
+			// Decode until the accumulator could run short of a code.
+			for (; bits >= MaxCodeLength && total > 0; --total)
+			{
+				const std::uint16_t entry = tables[previous * tableSize + ((accumulator >> (bits - MaxCodeLength)) & mask)];
+				if ((entry & 0x0F) == 0)
+					return EXIT_FAILURE;
+
+				previous = static_cast<unsigned char>(entry >> 4);
+				bits -= entry & 0x0F;
+				sink.put(previous);
+			}
+		}
+
+		return padding * 8 > static_cast<size_t>(bits) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	struct Counter
+	{
+		ContextHuffman& codec;
+		std::uint64_t& total;
+
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
+		{
+			return codec.count(source, sink, total);
+		}
+	};
+
+	struct Encoder
+	{
+		ContextHuffman& codec;
+
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
+		{
+			return codec.encode(source, sink);
+		}
+	};
+
+	struct Decoder
+	{
+		const ContextHuffman& codec;
+		std::uint64_t total;
+
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
+		{
+			return codec.decode(source, sink, total);
+		}
+	};
+
+public:
+
+	int compressFile(const std::string& inputPath, const std::string& outputPath)
+	{
+		std::ifstream is(inputPath, std::ios_base::binary);
+		std::ofstream os(outputPath, std::ios_base::binary);
+
+		if (!is.is_open() || !os.is_open())
+			return EXIT_FAILURE;
+
+		return compressStream(is, os);
+	}
+
+	int compressStream(std::istream& is, std::ostream& os)
+	{
+		const std::streampos start = is.tellg();
+		std::uint64_t total = 0;
+
+		const Counter counter = { *this, total };
+		runKernel(is, os, inputScratch, outputScratch, counter);
+
+		lengths.resize(Symbols * Symbols);
+		codes.resize(Symbols * Symbols);
+		for (int context = 0; context < Symbols; ++context)
+		{
+			codeLengths(&counts[context * Symbols], &lengths[context * Symbols], MaxCodeLength);
+			canonicalCodes(&lengths[context * Symbols], &codes[context * Symbols]);
+		}
+
+		addHeader(os);
+		os.write(reinterpret_cast<const char *>(&total), sizeof(total));
+		writeTables(os);
+
+		is.clear();
+		is.seekg(start);
+
+		const Encoder encoder = { *this };
+		const int result = runKernel(is, os, inputScratch, outputScratch, encoder);
+
+		return result == EXIT_SUCCESS && os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	int decompressFile(const std::string& inputPath, const std::string& outputPath)
+	{
+		std::ifstream is(inputPath, std::ios_base::binary);
+		std::ofstream os(outputPath, std::ios_base::binary);
+
+		if (!is.is_open() || !os.is_open())
+			return EXIT_FAILURE;
+
+		return decompressStream(is, os);
+	}
+
+	int decompressStream(std::istream& is, std::ostream& os)
+	{
+		if (!checkHeader(is))
+			return EXIT_FAILURE;
+
+		std::uint64_t total = 0;
+		if (!is.read(reinterpret_cast<char *>(&total), sizeof(total)) || readTables(is) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+
+		// Every code is at least one bit long.
+		std::uint64_t remaining;
+		if (remainingInput(is, remaining) && total / 8 > remaining)
+			return EXIT_FAILURE;
+
+		buildDecodeTables();
+
+		const Decoder decoder = { *this, total };
+		const int result = runKernel(is, os, inputScratch, outputScratch, decoder);
+
+		return result == EXIT_SUCCESS && os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	ContextHuffman(BaseCompression::PrivateKeyType key) : BaseCompression(key)
+	{
+	}
+};
\ No newline at end of file
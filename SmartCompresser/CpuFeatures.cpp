@@ -0,0 +1,146 @@
+#pragma once
+
+#include "stdafx.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// CPU_DISPATCH is defined where the kernels can be compiled for instruction sets
+// beyond the build's baseline; the CPU_TARGET_ macros mark the functions that use them.
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#define CPU_DISPATCH
+#define CPU_TARGET_SSE42
+#define CPU_TARGET_AVX2
+#define CPU_TARGET_AVX512
+#if _MSC_VER >= 1911
+#define CPU_DISPATCH_AVX512
+#endif
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define CPU_DISPATCH
+#define CPU_DISPATCH_AVX512
+#define CPU_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define CPU_TARGET_AVX2 __attribute__((target("avx2,bmi2")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx2,bmi2")))
+#endif
+
+/// Instruction set levels the SIMD kernels are built for, each one includes the ones
+/// before it. The kernels check cpuLevel, so one binary runs its best code everywhere.
+class CpuFeatures
+{
+public:
+	enum Level
+	{
+		Scalar,
+		Sse42,
+		Avx2,
+		Avx512
+	};
+
+	/// The highest level both the processor and the operating system support.
+	static Level detect()
+	{
+#ifdef CPU_DISPATCH
+		std::uint32_t basic[4];
+		cpuid(0, basic);
+		const std::uint32_t maxLeaf = basic[0];
+
+		std::uint32_t features[4];
+		cpuid(1, features);
+		if (!(features[2] & (1u << 20)))
+			return Scalar;
+
+		// AVX state has to be saved by the operating system, not only present in the processor.
+		const bool osSaves = (features[2] & (1u << 27)) != 0 && (features[2] & (1u << 28)) != 0;
+		const std::uint64_t state = osSaves ? xgetbv() : 0;
+		if ((state & 0x6) != 0x6 || maxLeaf < 7)
+			return Sse42;
+
+		std::uint32_t extended[4];
+		cpuid(7, extended);
+		const bool avx2 = (extended[1] & (1u << 5)) != 0 && (extended[1] & (1u << 8)) != 0;
+		if (!avx2)
+			return Sse42;
+
+#ifdef CPU_DISPATCH_AVX512
+		const bool avx512 = (extended[1] & (1u << 16)) != 0 && (extended[1] & (1u << 30)) != 0;
+		if (avx512 && (state & 0xE6) == 0xE6)
+			return Avx512;
+#endif
+		return Avx2;
+#else
+		return Scalar;
+#endif
+	}
+
+	static const char* name(Level level)
+	{
+		static const char* const names[] = { "scalar", "sse4.2", "avx2", "avx512" };
+		return names[level];
+	}
+
+	/// Level from its name(), false for unknown names.
+	static bool parse(const std::string& text, Level& level)
+	{
+		for (int candidate = Scalar; candidate <= Avx512; ++candidate)
+		{
+			if (text == name(static_cast<Level>(candidate)))
+			{
+				level = static_cast<Level>(candidate);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/// Index of the lowest set bit, value must not be zero.
+	static unsigned trailingZeros(std::uint64_t value)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanForward64(&index, value);
+		return index;
+#elif defined(_MSC_VER)
+		unsigned long index;
+		if (_BitScanForward(&index, static_cast<unsigned long>(value)))
+			return index;
+		_BitScanForward(&index, static_cast<unsigned long>(value >> 32));
+		return index + 32;
+#else
+		return static_cast<unsigned>(__builtin_ctzll(value));
+#endif
+	}
+
+private:
+#ifdef CPU_DISPATCH
+	static void cpuid(std::uint32_t leaf, std::uint32_t(&registers)[4])
+	{
+#ifdef _MSC_VER
+		int values[4];
+		__cpuidex(values, static_cast<int>(leaf), 0);
+		for (int i = 0; i < 4; ++i)
+			registers[i] = static_cast<std::uint32_t>(values[i]);
+#else
+		__cpuid_count(leaf, 0, registers[0], registers[1], registers[2], registers[3]);
+#endif
+	}
+
+	static std::uint64_t xgetbv()
+	{
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		std::uint32_t low, high;
+		__asm__ __volatile__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+		return (static_cast<std::uint64_t>(high) << 32) | low;
+#endif
+	}
+#endif
+};
+
+/// Level the kernels run at: the host's best, chosen before main and only ever lowered
+/// (the --cpu option) before any work starts.
+static CpuFeatures::Level cpuLevel = CpuFeatures::detect();
\ No newline at end of file
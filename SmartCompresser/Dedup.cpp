@@ -0,0 +1,487 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MemoryStream.cpp"
+#include <cstring>
+#include <streambuf>
+
+/// Deduplication pre-stage. The input is cut in content-defined chunks with a gear
+/// rolling hash, so an insertion only moves the boundaries next to it, and every chunk
+/// seen before is replaced by a reference to its first copy. The selected codec then
+/// compresses the resulting list of records:
+///
+///   literal:   0 | u32 length | bytes
+///   reference: 1 | u32 length | u64 offset of the same bytes in the decoded output
+///
+/// Both sides stream. DedupEncoder cuts the records while the codec reads them and only
+/// keeps an index from chunk fingerprints to input offsets; DedupDecoder expands them
+/// while the codec writes them and copies references from the output written so far.
+struct Dedup
+{
+	static const size_t MinChunk = 2 * 1024;
+	static const size_t MaxChunk = 64 * 1024;
+	static const size_t LiteralHeader = 1 + sizeof(std::uint32_t);
+	static const size_t ReferenceHeader = LiteralHeader + sizeof(std::uint64_t);
+
+	enum Tag
+	{
+		LiteralTag,
+		ReferenceTag
+	};
+};
+
+/// Read side: the record stream of the input attached to it. A codec that reads its
+/// input twice seeks back to the start, and the records are cut again the same way.
+/// A chunk only becomes a reference once its bytes compare equal to the earlier copy,
+/// read back from the input, so duplicates are only found in seekable input.
+class DedupEncoder : public std::streambuf
+{
+public:
+	DedupEncoder() : input(nullptr), used(0), epoch(1)
+	{
+		// Fixed pseudo-random table (splitmix64), chunk boundaries must never change.
+		std::uint64_t state = 0;
+		for (auto& value : gear)
+		{
+			std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			value = z ^ (z >> 31);
+		}
+
+		slots.resize(InitialSlots);
+	}
+
+	void attach(std::istream& is)
+	{
+		input = &is;
+		start = is.tellg();
+		reset();
+	}
+
+	/// False when reading the input failed.
+	bool detach()
+	{
+		const bool valid = !failed;
+		input = nullptr;
+		setg(nullptr, nullptr, nullptr);
+		return valid;
+	}
+
+protected:
+	int_type underflow() override
+	{
+		if (gptr() == egptr() && !nextRecord())
+			return traits_type::eof();
+
+		return traits_type::to_int_type(*gptr());
+	}
+
+	/// Only telling the position and going back to the start are supported.
+	pos_type seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+	{
+		if (!(which & std::ios_base::in) || offset != 0)
+			return pos_type(off_type(-1));
+
+		if (dir == std::ios_base::cur)
+			return pos_type(off_type(produced - static_cast<std::uint64_t>(egptr() - gptr())));
+
+		if (dir == std::ios_base::beg && restart())
+			return pos_type(off_type(0));
+
+		return pos_type(off_type(-1));
+	}
+
+	pos_type seekpos(pos_type position, std::ios_base::openmode which) override
+	{
+		return seekoff(off_type(position), std::ios_base::beg, which);
+	}
+
+private:
+	static const size_t WindowSize = 1 << 20;
+	// 13 high bits, about 8 KiB past MinChunk on average; high bits see the last 64 bytes.
+	static const std::uint64_t ChunkMask = 0xFFF8000000000000ull;
+
+	// Chunks seen so far, an open addressing table kept at most half full. A slot is in
+	// use when it carries the current epoch, so clearing the table is a counter increment.
+	static const size_t InitialSlots = 1 << 12;
+
+	struct Slot
+	{
+		std::uint64_t fingerprint;
+		std::uint64_t offset; // of the chunk in the input
+		std::uint32_t length;
+		std::uint32_t epoch;
+	};
+
+	std::istream* input;
+	std::streampos start;
+	std::uint64_t gear[256];
+	std::vector<Slot> slots;
+	size_t used;
+	std::uint32_t epoch;
+	bool failed;
+
+	// Input read so far and not yet dropped; window[0] is at windowOffset in the input.
+	std::vector<unsigned char> window;
+	std::uint64_t windowOffset;
+	size_t begin;
+	size_t end;
+	bool eof;
+
+	unsigned char header[Dedup::ReferenceHeader];
+	size_t literalBegin; // window position of the literal bytes due after the header
+	size_t literalSize;
+	std::uint64_t produced; // record bytes handed out, the current get area included
+	std::vector<unsigned char> earlier;
+
+	void reset()
+	{
+		clearChunks();
+		failed = false;
+		window.resize(WindowSize);
+		windowOffset = 0;
+		begin = 0;
+		end = 0;
+		eof = false;
+		literalSize = 0;
+		produced = 0;
+		setg(nullptr, nullptr, nullptr);
+	}
+
+	bool restart()
+	{
+		if (input == nullptr || start == std::streampos(-1))
+			return false;
+
+		input->clear();
+		if (!input->seekg(start))
+			return false;
+
+		reset();
+		return true;
+	}
+
+	void clearChunks()
+	{
+		used = 0;
+		if (++epoch != 0)
+			return;
+
+		// Every stale epoch could come back after wrapping around, so they go for good.
+		for (auto& slot : slots)
+			slot.epoch = 0;
+		epoch = 1;
+	}
+
+	/// The slot holding fingerprint, or the free one where it would go.
+	Slot& findChunk(std::uint64_t fingerprint)
+	{
+		const size_t mask = slots.size() - 1;
+		size_t index = static_cast<size_t>(fingerprint ^ (fingerprint >> 32)) & mask;
+
+		while (slots[index].epoch == epoch && slots[index].fingerprint != fingerprint)
+			index = (index + 1) & mask;
+
+		return slots[index];
+	}
+
+	void insertChunk(Slot& slot, std::uint64_t fingerprint, std::uint64_t offset, std::uint32_t length)
+	{
+		slot.fingerprint = fingerprint;
+		slot.offset = offset;
+		slot.length = length;
+		slot.epoch = epoch;
+
+		if (++used * 2 <= slots.size())
+			return;
+
+		// Doubling keeps the grown table for the next inputs.
+		std::vector<Slot> previous(slots.size() * 2);
+		previous.swap(slots);
+		for (const auto& entry : previous)
+		{
+			if (entry.epoch == epoch)
+				findChunk(entry.fingerprint) = entry;
+		}
+	}
+
+	size_t cut(const unsigned char* data, size_t size) const
+	{
+		if (size <= Dedup::MinChunk)
+			return size;
+
+		const size_t limit = std::min(size, static_cast<size_t>(Dedup::MaxChunk));
+		std::uint64_t hash = 0;
+
+		for (size_t i = Dedup::MinChunk; i < limit; ++i)
+		{
+			hash = (hash << 1) + gear[data[i]];
+			if ((hash & ChunkMask) == 0)
+				return i + 1;
+		}
+
+		return limit;
+	}
+
+	/// Keeps at least one maximal chunk ahead, so boundaries do not depend on the reads.
+	/// False at the end of the input.
+	bool fill()
+	{
+		if (!eof && end - begin < Dedup::MaxChunk)
+		{
+			std::copy(window.begin() + begin, window.begin() + end, window.begin());
+			windowOffset += begin;
+			end -= begin;
+			begin = 0;
+
+			input->read(reinterpret_cast<char*>(window.data() + end), window.size() - end);
+			end += static_cast<size_t>(input->gcount());
+			eof = !*input;
+			failed = failed || input->bad();
+		}
+
+		return begin != end;
+	}
+
+	/// Whether the chunk at data repeats the input at offset, from the window when it is
+	/// still there and read back from the input otherwise.
+	bool repeats(std::uint64_t offset, const unsigned char* data, size_t length)
+	{
+		if (offset >= windowOffset)
+			return std::equal(data, data + length, window.data() + (offset - windowOffset));
+
+		if (start == std::streampos(-1))
+			return false;
+
+		earlier.resize(length);
+		input->clear();
+		const bool read = input->seekg(start + static_cast<std::streamoff>(offset))
+			&& input->read(reinterpret_cast<char*>(earlier.data()), length);
+
+		// Back to where the window ends; eof is tracked apart, so the flags can go.
+		input->clear();
+		input->seekg(start + static_cast<std::streamoff>(windowOffset + end));
+		failed = failed || !*input;
+
+		return read && std::equal(data, data + length, earlier.begin());
+	}
+
+	/// Hands out the next record: a header, and after a literal header the bytes,
+	/// straight from the window. False at the end of the input.
+	bool nextRecord()
+	{
+		if (literalSize > 0)
+		{
+			char* bytes = reinterpret_cast<char*>(window.data() + literalBegin);
+			setg(bytes, bytes, bytes + literalSize);
+			produced += literalSize;
+			literalSize = 0;
+			return true;
+		}
+
+		if (failed || !fill())
+			return false;
+
+		const unsigned char* data = window.data() + begin;
+		const size_t length = cut(data, end - begin);
+		const std::uint64_t offset = windowOffset + begin;
+
+		std::uint64_t fingerprint = 14695981039346656037ull;
+		for (size_t i = 0; i < length; ++i)
+			fingerprint = (fingerprint ^ data[i]) * 1099511628211ull;
+
+		const std::uint32_t chunkLength = static_cast<std::uint32_t>(length);
+		Slot& found = findChunk(fingerprint);
+		const bool known = found.epoch == epoch;
+		const std::uint64_t foundOffset = found.offset;
+		size_t headerSize = Dedup::LiteralHeader;
+
+		std::memcpy(header + 1, &chunkLength, sizeof(chunkLength));
+		if (known && found.length == chunkLength && repeats(foundOffset, data, length))
+		{
+			header[0] = Dedup::ReferenceTag;
+			std::memcpy(header + Dedup::LiteralHeader, &foundOffset, sizeof(foundOffset));
+			headerSize = Dedup::ReferenceHeader;
+		}
+		else
+		{
+			header[0] = Dedup::LiteralTag;
+			literalBegin = begin;
+			literalSize = length;
+
+			if (!known)
+				insertChunk(found, fingerprint, offset, chunkLength);
+		}
+
+		begin += length;
+
+		char* bytes = reinterpret_cast<char*>(header);
+		setg(bytes, bytes, bytes + headerSize);
+		produced += headerSize;
+		return !failed;
+	}
+};
+
+/// Write side: expands the records written to it into the output attached to it. A
+/// reference is copied from what this stream wrote before: from memory for a
+/// VectorOutputBuffer, only counted for a NullOutputBuffer, and read back through the
+/// stream buffer otherwise, so files have to be open for reading as well.
+class DedupDecoder : public std::streambuf
+{
+public:
+	DedupDecoder() : output(nullptr), target(nullptr), memory(nullptr), discard(nullptr)
+	{
+	}
+
+	void attach(std::ostream& os)
+	{
+		output = &os;
+		target = os.rdbuf();
+		memory = dynamic_cast<VectorOutputBuffer*>(target);
+		discard = dynamic_cast<NullOutputBuffer*>(target);
+
+		if (memory != nullptr)
+			base = static_cast<std::uint64_t>(memory->written());
+		else if (discard != nullptr)
+			base = discard->written();
+		else
+		{
+			const std::streampos position = target->pubseekoff(0, std::ios_base::cur, std::ios_base::out);
+			base = position == std::streampos(-1) ? 0 : static_cast<std::uint64_t>(position);
+		}
+
+		written = 0;
+		filled = 0;
+		literalLeft = 0;
+		failed = false;
+	}
+
+	/// EXIT_SUCCESS when every record was whole and could be expanded.
+	int detach()
+	{
+		const bool valid = !failed && filled == 0 && literalLeft == 0 && *output;
+		output = nullptr;
+		return valid ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+protected:
+	int_type overflow(int_type c) override
+	{
+		if (traits_type::eq_int_type(c, traits_type::eof()))
+			return traits_type::not_eof(c);
+
+		const char value = traits_type::to_char_type(c);
+		return expand(&value, 1) ? traits_type::not_eof(c) : traits_type::eof();
+	}
+
+	std::streamsize xsputn(const char* data, std::streamsize count) override
+	{
+		return expand(data, count) ? count : 0;
+	}
+
+private:
+	std::ostream* output;
+	std::streambuf* target;
+	VectorOutputBuffer* memory;
+	NullOutputBuffer* discard;
+	std::uint64_t base;    // where the output of this stream starts in target
+	std::uint64_t written; // from base
+	unsigned char header[Dedup::ReferenceHeader];
+	size_t filled;
+	size_t literalLeft;
+	bool failed;
+	std::vector<unsigned char> earlier;
+
+	bool expand(const char* data, std::streamsize count)
+	{
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+		size_t size = static_cast<size_t>(count);
+
+		while (size > 0 && !failed)
+		{
+			if (literalLeft > 0)
+			{
+				const size_t take = std::min(size, literalLeft);
+				emit(bytes, take);
+				bytes += take;
+				size -= take;
+				literalLeft -= take;
+				continue;
+			}
+
+			header[filled++] = *bytes++;
+			--size;
+
+			if (header[0] != Dedup::LiteralTag && header[0] != Dedup::ReferenceTag)
+				failed = true;
+
+			if (filled < (header[0] == Dedup::LiteralTag ? Dedup::LiteralHeader : Dedup::ReferenceHeader))
+				continue;
+
+			std::uint32_t length = 0;
+			std::memcpy(&length, header + 1, sizeof(length));
+			filled = 0;
+
+			// The encoder never cuts empty chunks or chunks longer than MaxChunk.
+			if (length == 0 || length > Dedup::MaxChunk)
+				failed = true;
+			else if (header[0] == Dedup::LiteralTag)
+				literalLeft = length;
+			else
+			{
+				std::uint64_t offset = 0;
+				std::memcpy(&offset, header + Dedup::LiteralHeader, sizeof(offset));
+				copy(offset, length);
+			}
+		}
+
+		return !failed;
+	}
+
+	void emit(const unsigned char* data, size_t size)
+	{
+		output->write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+		written += size;
+		failed = failed || !*output;
+	}
+
+	void copy(std::uint64_t offset, size_t length)
+	{
+		if (offset > written || written - offset < length)
+		{
+			failed = true;
+			return;
+		}
+
+		if (discard != nullptr)
+		{
+			discard->discard(length);
+			written += length;
+			return;
+		}
+
+		// Copied out first: writing may move the memory or the file position.
+		earlier.resize(length);
+		if (memory != nullptr)
+		{
+			const unsigned char* source = memory->data() + static_cast<size_t>(base + offset);
+			std::copy(source, source + length, earlier.begin());
+		}
+		else
+		{
+			const std::streampos position = target->pubseekoff(0, std::ios_base::cur, std::ios_base::out);
+			const bool read = position != std::streampos(-1)
+				&& target->pubseekpos(static_cast<std::streamoff>(base + offset), std::ios_base::in) != std::streampos(-1)
+				&& target->sgetn(reinterpret_cast<char*>(earlier.data()), static_cast<std::streamsize>(length)) == static_cast<std::streamsize>(length);
+
+			if (!read || target->pubseekpos(position, std::ios_base::out) == std::streampos(-1))
+			{
+				failed = true;
+				return;
+			}
+		}
+
+		emit(earlier.data(), length);
+	}
+};
\ No newline at end of file
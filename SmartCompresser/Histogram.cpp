@@ -0,0 +1,164 @@
+#pragma once
+
+#include "stdafx.h"
+#include <cmath>
+#include "CpuFeatures.cpp"
+
+/// Byte histogram helpers shared by the codecs and by Smart mode.
+class Histogram
+{
+public:
+	static const int Symbols = 1 << CHAR_BIT;
+
+	/// Counts into four interleaved tables, so runs of the same byte do not
+	/// serialize on a single counter, then sums them into result.
+	static void count(const unsigned char* data, size_t size, std::uint64_t(&result)[Symbols])
+	{
+		std::fill(result, result + Symbols, 0);
+
+		// The 32 bit tables are drained often enough to never wrap.
+		const size_t chunkSize = size_t(1) << 30;
+		for (size_t offset = 0; offset < size; offset += chunkSize)
+			countChunk(data + offset, std::min(chunkSize, size - offset), result);
+	}
+
+	/// Order-0 Shannon entropy in bits per byte.
+	static double entropy(const std::uint64_t(&counts)[Symbols])
+	{
+		std::uint64_t total = 0;
+		for (int c = 0; c < Symbols; ++c)
+			total += counts[c];
+
+		if (total == 0)
+			return 0.0;
+
+		double bits = 0.0;
+		for (int c = 0; c < Symbols; ++c)
+		{
+			if (counts[c] == 0)
+				continue;
+
+			const double p = static_cast<double>(counts[c]) / total;
+			bits -= p * std::log(p);
+		}
+
+		return bits / std::log(2.0);
+	}
+
+	static double entropy(const unsigned char* data, size_t size)
+	{
+		std::uint64_t counts[Symbols];
+		count(data, size, counts);
+		return entropy(counts);
+	}
+
+private:
+
+	typedef std::uint32_t Tables[4][Symbols];
+
+	static void countChunk(const unsigned char* data, size_t size, std::uint64_t(&result)[Symbols])
+	{
+		Tables counts = { { 0 } };
+		size_t done = 0;
+
+#ifdef CPU_DISPATCH
+#ifdef CPU_DISPATCH_AVX512
+		if (cpuLevel >= CpuFeatures::Avx512)
+			done = countUniformBlocks512(data, size, counts);
+		else
+#endif
+		if (cpuLevel >= CpuFeatures::Avx2)
+			done = countUniformBlocks256(data, size, counts);
+		else if (cpuLevel >= CpuFeatures::Sse42)
+			done = countUniformBlocks128(data, size, counts);
+#endif
+
+		countBytes(data + done, size - done, counts);
+
+		for (int c = 0; c < Symbols; ++c)
+			result[c] += std::uint64_t(counts[0][c]) + counts[1][c] + counts[2][c] + counts[3][c];
+	}
+
+	static void countBytes(const unsigned char* data, size_t size, Tables& counts)
+	{
+		size_t i = 0;
+
+		for (; i + 4 <= size; i += 4)
+		{
+			++counts[0][data[i]];
+			++counts[1][data[i + 1]];
+			++counts[2][data[i + 2]];
+			++counts[3][data[i + 3]];
+		}
+		for (; i < size; ++i)
+			++counts[0][data[i]];
+	}
+
+#ifdef CPU_DISPATCH
+	// Counting itself stays scalar: the increments scatter over the tables and do not
+	// vectorize. The vector code only finds 64 byte blocks of one repeated byte (runs,
+	// silence, padding) and counts each with a single addition; mixed blocks still go
+	// through countBytes. The kernels return how many bytes they took.
+	static const size_t UniformBlock = 64;
+
+	CPU_TARGET_SSE42 static size_t countUniformBlocks128(const unsigned char* data, size_t size, Tables& counts)
+	{
+		size_t i = 0;
+		for (; i + UniformBlock <= size; i += UniformBlock)
+		{
+			const __m128i first = _mm_set1_epi8(static_cast<char>(data[i]));
+			__m128i equal = _mm_set1_epi8(-1);
+			for (size_t offset = 0; offset < UniformBlock; offset += 16)
+			{
+				const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + offset));
+				equal = _mm_and_si128(equal, _mm_cmpeq_epi8(bytes, first));
+			}
+
+			if (_mm_movemask_epi8(equal) == 0xFFFF)
+				counts[0][data[i]] += UniformBlock;
+			else
+				countBytes(data + i, UniformBlock, counts);
+		}
+
+		return i;
+	}
+
+	CPU_TARGET_AVX2 static size_t countUniformBlocks256(const unsigned char* data, size_t size, Tables& counts)
+	{
+		size_t i = 0;
+		for (; i + UniformBlock <= size; i += UniformBlock)
+		{
+			const __m256i first = _mm256_set1_epi8(static_cast<char>(data[i]));
+			const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+			const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+			const __m256i equal = _mm256_and_si256(_mm256_cmpeq_epi8(low, first), _mm256_cmpeq_epi8(high, first));
+
+			if (_mm256_movemask_epi8(equal) == -1)
+				counts[0][data[i]] += UniformBlock;
+			else
+				countBytes(data + i, UniformBlock, counts);
+		}
+
+		return i;
+	}
+
+#ifdef CPU_DISPATCH_AVX512
+	CPU_TARGET_AVX512 static size_t countUniformBlocks512(const unsigned char* data, size_t size, Tables& counts)
+	{
+		size_t i = 0;
+		for (; i + UniformBlock <= size; i += UniformBlock)
+		{
+			const __m512i bytes = _mm512_loadu_si512(data + i);
+			const __m512i first = _mm512_set1_epi8(static_cast<char>(data[i]));
+
+			if (_mm512_cmpeq_epi8_mask(bytes, first) == ~__mmask64(0))
+				counts[0][data[i]] += UniformBlock;
+			else
+				countBytes(data + i, UniformBlock, counts);
+		}
+
+		return i;
+	}
+#endif
+#endif
+};
\ No newline at end of file
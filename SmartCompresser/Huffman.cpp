@@ -1,9 +1,11 @@
+#pragma once
+
 #include "stdafx.h"
-#include "BitFileManager.cpp"
+#include "BitIO.cpp"
 #include "BaseCompression.h"
+#include "WorkerPool.cpp"
+#include "Histogram.cpp"
 #include <iostream>
-#include <queue>
-#include <map>
 #include <climits> // for CHAR_BIT
 #include <iterator>
 #include <algorithm>
@@ -12,180 +14,646 @@ class Huffman: public BaseCompression
 {
 	static const int UniqueSymbols = 1 << CHAR_BIT;
 	
-	typedef std::vector<bool> HuffmanCode;
-	typedef std::map<char, HuffmanCode> HuffCodeMapping;
-	typedef std::map<HuffmanCode, char> HuffDecodeMapping;
-
+	// The model lives in fixed pools sized for the whole alphabet: building a tree or
+	// reading a table takes no allocations and starting over is only resetting a count.
+	static const int MaxNodes = 2 * UniqueSymbols - 1;
+	// A code is at most UniqueSymbols - 1 bits long.
+	static const int MaxCodeBytes = UniqueSymbols / 8;
 
-	class INode
+	struct TreeNode
 	{
-	public:
-		const int frequency;
+		std::uint64_t frequency;
+		int child[2]; // -1 for leaves
+		int symbol;   // -1 for inner nodes
+	};
 
-		virtual ~INode() {}
+	struct NodeComparator
+	{
+		const TreeNode* nodes;
 
-	protected:
-		INode(int frecv) : frequency(frecv) {}
+		bool operator()(int lhs, int rhs) const { return nodes[lhs].frequency > nodes[rhs].frequency; }
 	};
 
-	class InternalNode : public INode
+	TreeNode tree[MaxNodes];
+	int treeSize;
+	std::vector<int> heap;
+	unsigned char codeLength[UniqueSymbols];
+	unsigned char codeWords[UniqueSymbols][MaxCodeBytes]; // most significant bit first
+
+	/// Builds the tree in the node pool: leaves first, then inner nodes in the order they
+	/// are made. Returns the root, -1 when there are no symbols.
+	int buildTree(const std::uint64_t(&frequencies)[UniqueSymbols])
 	{
-	public:
-		INode *const left;
-		INode *const right;
+		const NodeComparator comparator = { tree };
+		treeSize = 0;
+		heap.clear();
 
-		InternalNode(INode* c0, INode* c1) : INode(c0->frequency + c1->frequency), left(c0), right(c1) {}
-		~InternalNode()
+		for (int i = 0; i < UniqueSymbols; ++i)
 		{
-			delete left;
-			delete right;
+			if (frequencies[i] == 0)
+				continue;
+
+			const TreeNode leaf = { frequencies[i], { -1, -1 }, i };
+			tree[treeSize] = leaf;
+			heap.push_back(treeSize++);
+			std::push_heap(heap.begin(), heap.end(), comparator);
+		}
+
+		while (heap.size() > 1)
+		{
+			std::pop_heap(heap.begin(), heap.end(), comparator);
+			const int first = heap.back();
+			heap.pop_back();
+
+			std::pop_heap(heap.begin(), heap.end(), comparator);
+			const int second = heap.back();
+			heap.pop_back();
+
+			const TreeNode inner = { tree[first].frequency + tree[second].frequency, { first, second }, -1 };
+			tree[treeSize] = inner;
+			heap.push_back(treeSize++);
+			std::push_heap(heap.begin(), heap.end(), comparator);
 		}
-	};
 
-	class LeafNode : public INode
+		return heap.empty() ? -1 : heap.front();
+	}
+
+	/// Codes are the paths from the root, 0 for the first child and 1 for the second.
+	void assignCodes(int node, int depth, unsigned char(&path)[MaxCodeBytes])
 	{
-	public:
-		const char c;
+		if (tree[node].symbol >= 0)
+		{
+			codeLength[tree[node].symbol] = static_cast<unsigned char>(depth);
+			std::copy(path, path + MaxCodeBytes, codeWords[tree[node].symbol]);
+			return;
+		}
+
+		const unsigned char mask = static_cast<unsigned char>(0x80 >> (depth & 7));
+		path[depth >> 3] &= ~mask;
+		assignCodes(tree[node].child[0], depth + 1, path);
 
-		LeafNode(int f, char c) : INode(f), c(c) {}
+		path[depth >> 3] |= mask;
+		assignCodes(tree[node].child[1], depth + 1, path);
+	}
+
+	int codeBit(int symbol, int bit) const
+	{
+		return (codeWords[symbol][bit >> 3] >> (7 - (bit & 7))) & 1;
+	}
+
+	/// Little endian, one byte at a time.
+	template <class T>
+	static void writeValue(std::ostream& os, T value)
+	{
+		for (size_t i = 0; i < sizeof(T); ++i)
+			os.put(static_cast<char>(static_cast<unsigned char>(value >> (8 * i))));
+	}
+
+	template <class T>
+	static bool readValue(std::istream& is, T& value)
+	{
+		value = 0;
+		for (size_t i = 0; i < sizeof(T); ++i)
+		{
+			const int data = is.get();
+			if (data == std::char_traits<char>::eof())
+				return false;
+
+			value |= static_cast<T>(static_cast<T>(data) << (8 * i));
+		}
+
+		return true;
+	}
+
+	// Decoding walks a tree built from the table; the first LookupBits bits of a code
+	// are resolved at once through the lookup table.
+	static const int LookupBits = 11;
+
+	struct DecodeNode
+	{
+		int child[2];
+		int symbol; // -1 for inner nodes
 	};
 
-	struct NodeComparator
+	struct LookupEntry
 	{
-		bool operator()(const INode* lhs, const INode* rhs) const { return lhs->frequency > rhs->frequency; }
+		int node;             // node reached after LookupBits bits, -1 if there is none
+		unsigned char symbol;
+		unsigned char length; // code length when a leaf was reached, 0 otherwise
 	};
 
-	INode* BuildHuffmanTree(const int(&frequencies)[UniqueSymbols])
+	DecodeNode nodes[MaxNodes];
+	int nodeCount;
+	LookupEntry lookup[1 << LookupBits];
+
+	/// Follows one bit of a code down the decoding tree, adding the node when it is new.
+	/// -1 if the code runs through a leaf or there are more nodes than a table can need.
+	int descend(int node, int bit)
 	{
-		std::priority_queue<INode*, std::vector<INode*>, NodeComparator> tree;
+		if (nodes[node].symbol >= 0)
+			return -1;
 
-		for (int i = 0; i < UniqueSymbols; ++i)
-		if (frequencies[i] > 0)
-			tree.push(new LeafNode(frequencies[i], (char)i));
+		if (nodes[node].child[bit] < 0)
+		{
+			if (nodeCount == MaxNodes)
+				return -1;
+
+			const DecodeNode inner = { { -1, -1 }, -1 };
+			nodes[nodeCount] = inner;
+			nodes[node].child[bit] = nodeCount++;
+		}
+
+		return nodes[node].child[bit];
+	}
+
+	/// Ends a code at node, false if another code passes through or ends there.
+	bool setLeaf(int node, unsigned char symbol)
+	{
+		if (nodes[node].symbol >= 0 || nodes[node].child[0] >= 0 || nodes[node].child[1] >= 0)
+			return false;
+
+		nodes[node].symbol = symbol;
+		return true;
+	}
 
-		while (tree.size() > 1)
+	void buildLookup()
+	{
+		for (int prefix = 0; prefix < (1 << LookupBits); ++prefix)
 		{
-			INode* childR = tree.top();
-			tree.pop();
+			LookupEntry& entry = lookup[prefix];
+			entry.node = 0;
+			entry.symbol = 0;
+			entry.length = 0;
+
+			for (int bit = LookupBits - 1; bit >= 0 && entry.node >= 0; --bit)
+			{
+				entry.node = nodes[entry.node].child[(prefix >> bit) & 1];
+				if (entry.node >= 0 && nodes[entry.node].symbol >= 0)
+				{
+					entry.symbol = static_cast<unsigned char>(nodes[entry.node].symbol);
+					entry.length = static_cast<unsigned char>(LookupBits - bit);
+					break;
+				}
+			}
+		}
+	}
+
+	/// Decodes total symbols from whatever source the bits come in.
+	template <class Source, class Sink>
+	int decode(Source& source, Sink& sink, std::uint64_t total) const
+	{
+		BitReader<Source> reader(source);
+		const LookupEntry* table = lookup;
+		const DecodeNode* tree = nodes;
 
-			INode* childL = tree.top();
-			tree.pop();
+		for (; total > 0; --total)
+		{
+			const LookupEntry& entry = table[reader.peek(LookupBits)];
+			if (entry.length > 0)
+			{
+				if (!reader.skip(entry.length))
+					return EXIT_FAILURE;
 
-			INode* parent = new InternalNode(childR, childL);
-			tree.push(parent);
+				sink.put(entry.symbol);
+				continue;
+			}
+
+			if (entry.node < 0 || !reader.skip(LookupBits))
+				return EXIT_FAILURE;
+
+			// Codes longer than the lookup go on bit by bit.
+			int node = entry.node;
+			std::uint32_t bit;
+			while (node >= 0 && tree[node].symbol < 0 && reader.read(1, bit))
+				node = tree[node].child[bit];
+
+			if (node < 0 || tree[node].symbol < 0)
+				return EXIT_FAILURE;
+
+			sink.put(static_cast<unsigned char>(tree[node].symbol));
 		}
-		return tree.top();
+
+		return EXIT_SUCCESS;
 	}
 
-	void GenerateHuffmanCodes(const INode* node, const HuffmanCode& prefix, HuffCodeMapping& outCodes)
+	struct Decoder
 	{
-		if (const LeafNode* lf = dynamic_cast<const LeafNode*>(node))
+		const Huffman& codec;
+		std::uint64_t total;
+
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
 		{
-			outCodes[lf->c] = prefix;
+			return codec.decode(source, sink, total);
 		}
-		else if (const InternalNode* in = dynamic_cast<const InternalNode*>(node))
+	};
+
+	// Input is processed in blocks, each block split in one segment per thread.
+	static const size_t BlockSize = 1 << 22;
+	static const size_t MinSegmentSize = 1 << 16;
+	// Longest code the 64 bit accumulator of encodeSegment can take next to 7 pending bits.
+	static const size_t MaxFastCodeLength = 56;
+
+	unsigned threads;
+	std::vector<unsigned char> block;
+	std::vector<unsigned char> encoded;
+	std::vector<unsigned char> inputScratch;
+	std::vector<unsigned char> outputScratch;
+	std::vector<std::array<std::uint64_t, UniqueSymbols>> partial;
+	std::vector<size_t> segmentBits;
+	std::vector<size_t> startBit;
+	std::vector<unsigned char> heads;
+	std::vector<unsigned char> tails;
+
+	unsigned segmentsFor(size_t size) const
+	{
+		return static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, size / MinSegmentSize)));
+	}
+
+	/// Encodes one segment starting at bit startBit of the shared output. Bytes owned
+	/// only by this segment are stored directly; the first and last ones may be shared
+	/// with the neighbours, so they are returned in head and tail to be merged afterwards.
+	static void encodeSegment(const unsigned char* data, size_t size, const std::uint64_t* codeBits,
+		const unsigned char(&codeLength)[UniqueSymbols], size_t startBit, unsigned char* output,
+		unsigned char& head, unsigned char& tail)
+	{
+		const size_t firstByte = startBit >> 3;
+		size_t position = firstByte;
+		std::uint64_t accumulator = 0;
+		unsigned pending = static_cast<unsigned>(startBit & 7);
+
+		head = 0;
+		tail = 0;
+
+		for (size_t i = 0; i < size; ++i)
+		{
+			accumulator = (accumulator << codeLength[data[i]]) | codeBits[data[i]];
+			pending += codeLength[data[i]];
+
+			while (pending >= 8)
+			{
+				pending -= 8;
+				const unsigned char byte = static_cast<unsigned char>(accumulator >> pending);
+
+				if (position == firstByte)
+					head |= byte;
+				else
+					output[position] = byte;
+				position++;
+			}
+		}
+
+		if (pending > 0)
+		{
+			const unsigned char byte = static_cast<unsigned char>(accumulator << (8 - pending));
+
+			if (position == firstByte)
+				head |= byte;
+			else
+				tail = byte;
+		}
+	}
+
+	/// First pass: the histogram of every block, split across threads.
+	template <class Source, class Sink>
+	int count(Source& source, Sink&, std::uint64_t* frequencies)
+	{
+		const unsigned char* data;
+		size_t size;
+		while ((size = source.take(BlockSize, block, data)) > 0)
 		{
-			HuffmanCode leftPrefix = prefix;
-			leftPrefix.push_back(false);
-			GenerateHuffmanCodes(in->left, leftPrefix, outCodes);
+			const unsigned segments = segmentsFor(size);
 
-			HuffmanCode rightPrefix = prefix;
-			rightPrefix.push_back(true);
-			GenerateHuffmanCodes(in->right, rightPrefix, outCodes);
+			parallelFor(segments, [&](unsigned segment)
+			{
+				const size_t begin = size * segment / segments;
+				const size_t end = size * (segment + 1) / segments;
+				std::uint64_t counts[UniqueSymbols];
+
+				Histogram::count(data + begin, end - begin, counts);
+				std::copy(counts, counts + UniqueSymbols, partial[segment].begin());
+			});
+
+			for (unsigned segment = 0; segment < segments; ++segment)
+			for (int c = 0; c < UniqueSymbols; ++c)
+				frequencies[c] += partial[segment][c];
 		}
+
+		return EXIT_SUCCESS;
 	}
+
+	/// Second pass: the code bits. The table is made of whole bytes, so they start byte aligned.
+	template <class Source, class Sink>
+	int encode(Source& source, Sink& sink, const std::uint64_t* codeBits, size_t maxLength)
+	{
+		if (maxLength > MaxFastCodeLength)
+		{
+			BitWriter<Sink> writer(sink);
+
+			unsigned char data;
+			while (source.get(data))
+			{
+				for (int bit = 0; bit < codeLength[data]; bit += 8)
+				{
+					const int count = std::min(8, codeLength[data] - bit);
+					writer.write(codeWords[data][bit >> 3] >> (8 - count), count);
+				}
+			}
+
+			writer.flush();
+			return EXIT_SUCCESS;
+		}
+
+		segmentBits.resize(threads);
+		heads.resize(threads);
+		tails.resize(threads);
+		unsigned char carry = 0;
+		size_t carryBits = 0;
+
+		const unsigned char* data;
+		size_t size;
+		while ((size = source.take(BlockSize, block, data)) > 0)
+		{
+			const unsigned segments = segmentsFor(size);
+
+			parallelFor(segments, [&](unsigned segment)
+			{
+				const size_t begin = size * segment / segments;
+				const size_t end = size * (segment + 1) / segments;
+				size_t bits = 0;
+
+				for (size_t i = begin; i < end; ++i)
+					bits += codeLength[data[i]];
+				segmentBits[segment] = bits;
+			});
+
+			// Prefix sum of the segment lengths gives every thread its bit offset.
+			startBit.assign(segments + 1, carryBits);
+			for (unsigned segment = 0; segment < segments; ++segment)
+				startBit[segment + 1] = startBit[segment] + segmentBits[segment];
+
+			const size_t totalBits = startBit[segments];
+			encoded.assign((totalBits + 7) >> 3, 0);
+
+			parallelFor(segments, [&](unsigned segment)
+			{
+				const size_t begin = size * segment / segments;
+				const size_t end = size * (segment + 1) / segments;
+
+				encodeSegment(data + begin, end - begin, codeBits, codeLength, startBit[segment], encoded.data(),
+					heads[segment], tails[segment]);
+			});
+
+			if (!encoded.empty())
+				encoded[0] |= carry;
+			for (unsigned segment = 0; segment < segments; ++segment)
+			{
+				if (segmentBits[segment] == 0)
+					continue;
+
+				encoded[startBit[segment] >> 3] |= heads[segment];
+				if (((startBit[segment + 1] - 1) >> 3) != (startBit[segment] >> 3))
+					encoded[(startBit[segment + 1] - 1) >> 3] |= tails[segment];
+			}
+
+			// The last partial byte is carried into the next block.
+			const size_t fullBytes = totalBits >> 3;
+			sink.write(encoded.data(), fullBytes);
+			carryBits = totalBits & 7;
+			carry = carryBits > 0 ? encoded[fullBytes] : 0;
+		}
+
+		if (carryBits > 0)
+			sink.put(carry);
+
+		return EXIT_SUCCESS;
+	}
+
+	struct Counter
+	{
+		Huffman& codec;
+		std::uint64_t* frequencies;
+
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
+		{
+			return codec.count(source, sink, frequencies);
+		}
+	};
+
+	struct Encoder
+	{
+		Huffman& codec;
+		const std::uint64_t* codeBits;
+		size_t maxLength;
+
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
+		{
+			return codec.encode(source, sink, codeBits, maxLength);
+		}
+	};
+
 public:
 
 	int compressFile(const std::string& inputPath, const std::string& outputPath)
 	{
-		// Build frequency table
-		int frequencies[UniqueSymbols] = { 0 };
 		std::ifstream is(inputPath, std::ios_base::binary);
+		std::ofstream os(outputPath, std::ios_base::binary);
 
-		if (!is.is_open())
+		if (!is.is_open() || !os.is_open())
 			return EXIT_FAILURE;
 
-		unsigned char data;
-		while (is.get(reinterpret_cast<char&>(data)))
-			++frequencies[data];
+		return compressStream(is, os);
+	}
 
-		INode* treeRoot = BuildHuffmanTree(frequencies);
+	/// The input is read twice, so it has to be seekable. Both the histogram and the
+	/// encoding of every block are split across threads; the output does not depend on
+	/// the number of threads.
+	int compressStream(std::istream& is, std::ostream& output)
+	{
+		// Build frequency table
+		std::uint64_t frequencies[UniqueSymbols] = { 0 };
+		partial.resize(threads);
+
+		const Counter counter = { *this, frequencies };
+		runKernel(is, output, inputScratch, outputScratch, counter);
+
+		std::fill(codeLength, codeLength + UniqueSymbols, 0);
+		const int root = buildTree(frequencies);
+		if (root >= 0 && tree[root].symbol >= 0)
+		{
+			// A lone symbol still takes one bit, so the data bounds the input length.
+			codeLength[tree[root].symbol] = 1;
+			std::fill(codeWords[tree[root].symbol], codeWords[tree[root].symbol] + MaxCodeBytes, 0);
+		}
+		else if (root >= 0)
+		{
+			unsigned char path[MaxCodeBytes] = { 0 };
+			assignCodes(root, 0, path);
+		}
 
-		HuffCodeMapping codes;
-		GenerateHuffmanCodes(treeRoot, HuffmanCode(), codes);
-		delete treeRoot;
 		is.clear();
 		is.seekg(0, std::ios::beg);
 
-		BitFileManager os(BitFileManager::Mode::Write, outputPath);
-		addHeader(os.getOStream());
-		for (HuffCodeMapping::const_iterator it = codes.begin(); it != codes.end(); ++it)
+		std::uint64_t total = 0;
+		std::uint16_t symbols = 0;
+		for (int c = 0; c < UniqueSymbols; ++c)
 		{
-			unsigned char data = static_cast<unsigned char>(it->first);
-			os.write(data);
-
-			std::vector<bool> coded = codes[data];
-			for (const auto& it : coded)
-				it == true ? os.write('1') : os.write('0');
+			total += frequencies[c];
+			symbols += frequencies[c] > 0 ? 1 : 0;
 		}
-		os.write((char)0);
 
-		while (is.get(reinterpret_cast<char&>(data)))
+		// Table: symbol count, input length, then per symbol its byte, code length and code
+		// (packed most significant bit first, the last byte padded with zeros).
+		addHeader(output);
+		writeValue(output, symbols);
+		writeValue(output, total);
+		for (int c = CHAR_MIN; c <= CHAR_MAX; ++c)
 		{
-			std::vector<bool> coded = codes[data];
-			for (const auto& it : coded)
-				os.write(it);
+			const unsigned char symbol = static_cast<unsigned char>(c);
+			if (frequencies[symbol] == 0)
+				continue;
+
+			const int bytes = (codeLength[symbol] + 7) / 8;
+			const int padding = bytes * 8 - codeLength[symbol];
+			output.put(static_cast<char>(symbol));
+			output.put(static_cast<char>(codeLength[symbol]));
+			output.write(reinterpret_cast<const char*>(codeWords[symbol]), bytes - 1);
+			output.put(static_cast<char>(codeWords[symbol][bytes - 1] >> padding << padding));
 		}
 
-		is.close();
+		std::uint64_t codeBits[UniqueSymbols] = { 0 };
+		size_t maxLength = 0;
 
-		return EXIT_SUCCESS;
+		for (int symbol = 0; symbol < UniqueSymbols; ++symbol)
+		{
+			maxLength = std::max<size_t>(maxLength, codeLength[symbol]);
+			if (codeLength[symbol] > MaxFastCodeLength)
+				continue;
+
+			for (int bit = 0; bit < codeLength[symbol]; ++bit)
+				codeBits[symbol] = (codeBits[symbol] << 1) | codeBit(symbol, bit);
+		}
+
+		const Encoder encoder = { *this, codeBits, maxLength };
+		return runKernel(is, output, inputScratch, outputScratch, encoder);
 	}
 
 	int decompressFile(const std::string& inputPath, const std::string& outputPath)
 	{
-		// Build frequency table
+		std::ifstream is(inputPath, std::ios_base::binary);
 		std::ofstream os(outputPath, std::ios_base::binary);
-		if (!os.is_open())
+
+		if (!is.is_open() || !os.is_open())
 			return EXIT_FAILURE;
 
-		BitFileManager is(BitFileManager::Mode::Read, inputPath);
-		if(!checkHeader(is.getIStream()))
+		return decompressStream(is, os);
+	}
+
+	int decompressStream(std::istream& input, std::ostream& os)
+	{
+		if(!checkHeader(input))
+			return EXIT_FAILURE;
+
+		std::uint16_t symbols = 0;
+		std::uint64_t total = 0;
+		bool valid = readValue(input, symbols) && readValue(input, total) && symbols <= UniqueSymbols;
+
+		const DecodeNode root = { { -1, -1 }, -1 };
+		nodes[0] = root;
+		nodeCount = 1;
+
+		for (std::uint16_t i = 0; i < symbols && valid; ++i)
+		{
+			const int data = input.get();
+			const int length = input.get();
+			unsigned char code[MaxCodeBytes];
+			valid = length > 0 && input.read(reinterpret_cast<char*>(code), (length + 7) / 8);
+
+			int node = 0;
+			for (int bit = 0; valid && bit < length; ++bit)
+			{
+				node = descend(node, (code[bit >> 3] >> (7 - (bit & 7))) & 1);
+				valid = node >= 0;
+			}
+
+			valid = valid && setLeaf(node, static_cast<unsigned char>(data));
+		}
+
+		// Every code is at least one bit long.
+		std::uint64_t remaining;
+		if (!valid || (remainingInput(input, remaining) && total / 8 > remaining))
 			return EXIT_FAILURE;
 
-		HuffDecodeMapping decodes;
-		unsigned char data;
+		// The last byte is padded, so decoding stops after the input length instead of at the end.
+		buildLookup();
+		const Decoder decoder = { *this, total };
+		return runKernel(input, os, inputScratch, outputScratch, decoder);
+	}
+
+	/// Decodes the table layout of the first releases, written under another key (the
+	/// caller has matched it): per symbol its byte and its code as '0' and '1'
+	/// characters, a zero byte, then the code bits up to the end of the stream. Nothing
+	/// writes it any more. Like the old decoder it has no input length, so padding bits
+	/// that complete a code decode too.
+	int decompressLegacy(std::istream& input, std::ostream& os)
+	{
+		input.get();
+
+		const DecodeNode root = { { -1, -1 }, -1 };
+		nodes[0] = root;
+		nodeCount = 1;
 
-		for (is.read(data); data != 0;)
+		int data = input.get();
+		while (data > 0)
 		{
-			unsigned char code;
-			std::vector<bool> enc;
-			for (is.read(code); code == '0' || code == '1'; is.read(code))
-				enc.push_back(code == '0' ? false : true);
+			int node = 0;
+			int code = input.get();
+			for (; node >= 0 && (code == '0' || code == '1'); code = input.get())
+				node = descend(node, code - '0');
+
+			if (node < 0 || !setLeaf(node, static_cast<unsigned char>(data)))
+				return EXIT_FAILURE;
 
-			decodes[enc] = data;
 			data = code;
 		}
 
-		bool bit;
-		std::vector<bool> enc;
-		while (is.read(bit) == EXIT_SUCCESS)
+		if (data != 0)
+			return EXIT_FAILURE;
+
+		StreamSource source(input, inputScratch);
+		StreamSink sink(os, outputScratch);
+		BitReader<StreamSource> reader(source);
+		std::uint32_t bit;
+		int node = 0;
+
+		while (reader.read(1, bit))
 		{
-			enc.push_back(bit);
+			node = nodes[node].child[bit];
+			if (node < 0)
+				return EXIT_FAILURE;
 
-			auto it = decodes.find(enc);
-			if (it != decodes.end())
+			if (nodes[node].symbol >= 0)
 			{
-				enc.clear();
-				os.write(reinterpret_cast<const char *> (&it->second), sizeof (char));
+				sink.put(static_cast<unsigned char>(nodes[node].symbol));
+				node = 0;
 			}
 		}
 
-		os.close();
-		
-		return EXIT_SUCCESS;
+		sink.flush();
+		return os ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 
-	Huffman(BaseCompression::PrivateKeyType key) : BaseCompression(key)
-	{};
+	/// Number of threads used per block, 0 means one per hardware thread.
+	void setThreads(unsigned count)
+	{
+		threads = count == 0 ? std::max(1u, std::thread::hardware_concurrency()) : count;
+	}
+
+	Huffman(BaseCompression::PrivateKeyType key) : BaseCompression(key), treeSize(0), nodeCount(0)
+	{
+		heap.reserve(UniqueSymbols);
+		setThreads(0);
+	};
 };
\ No newline at end of file
@@ -1,5 +1,9 @@
+#pragma once
+
 #include "stdafx.h"
 #include "BaseCompression.h"
+#include "BitIO.cpp"
+#include "PresetDictionary.cpp"
 
 
 inline std::vector<char> operator + (std::vector<char> vc, char c)
@@ -39,7 +43,7 @@ class LZWCompressor: public BaseCompression
 		};
 
 	public:
-		Dictionary()
+		explicit Dictionary(const PresetDictionary* preset_ = nullptr) : preset(preset_), count(0)
 		{
 			const int minCharValue = std::numeric_limits<char>::min();
 			const int maxCharValue = std::numeric_limits<char>::max();
@@ -48,29 +52,39 @@ class LZWCompressor: public BaseCompression
 			for (int c = minCharValue; c <= maxCharValue; ++c)
 				initials[static_cast<unsigned char> (c)] = k++;
 
-			bTreeNodes.reserve(dictMaxSize);
-			resetValues();
+			// Fixed capacity, allocated once; a full dictionary starts over in place.
+			bTreeNodes.resize(dictMaxSize, Node(0));
+			prepare();
 		}
 
+		/// Back to the entries prepare() made, a copy of a few hundred nodes.
 		void resetValues()
 		{
-			const int minCharValue = std::numeric_limits<char>::min();
-			const int maxCharValue = std::numeric_limits<char>::max();
-			
-			bTreeNodes.clear();
-			for (int c = minCharValue; c <= maxCharValue; ++c)
-				bTreeNodes.push_back(Node(static_cast<char>(c)));
+			std::copy(initialNodes.begin(), initialNodes.end(), bTreeNodes.begin());
+			count = static_cast<KeyType>(initialNodes.size());
+		}
+
+		/// Prepares the entries every reset starts from: the single bytes, then the preset.
+		void setPreset(const PresetDictionary* dictionary)
+		{
+			preset = dictionary;
+			prepare();
+		}
+
+		size_t size() const
+		{
+			return count;
 		}
 
 		KeyType searchInsert(KeyType i, char data)
 		{
-			if (bTreeNodes.size() == dictMaxSize)
+			if (count == dictMaxSize)
 				resetValues();
 
 			if (i == dictMaxSize)
 				return searchInitials(data);
 
-			const KeyType treeSize = bTreeNodes.size();
+			const KeyType treeSize = count;
 			KeyType currentIndex = bTreeNodes[i].first;
 
 			if (currentIndex != dictMaxSize)
@@ -102,7 +116,7 @@ class LZWCompressor: public BaseCompression
 			else
 				bTreeNodes[i].first = treeSize;
 
-			bTreeNodes.push_back(Node(data));
+			bTreeNodes[count++] = Node(data);
 			return dictMaxSize;
 		}
 
@@ -113,100 +127,197 @@ class LZWCompressor: public BaseCompression
 
 	private:
 
+		const PresetDictionary* preset;
 		std::vector<Node> bTreeNodes;
+		KeyType count;
+		std::vector<Node> initialNodes;
 		std::array<KeyType, 1u << CHAR_BIT> initials;
+
+		void prepare()
+		{
+			const int minCharValue = std::numeric_limits<char>::min();
+			const int maxCharValue = std::numeric_limits<char>::max();
+
+			count = 0;
+			for (int c = minCharValue; c <= maxCharValue; ++c)
+				bTreeNodes[count++] = Node(static_cast<char>(c));
+
+			if (preset != nullptr)
+			{
+				for (const auto& entry : preset->getEntries())
+					searchInsert(entry.first, entry.second);
+			}
+
+			initialNodes.assign(bTreeNodes.begin(), bTreeNodes.begin() + count);
+		}
 	};
 
-	void compress(std::istream &is, std::ostream &os)
+	const PresetDictionary* preset = nullptr;
+
+	// Kept between calls so the node storage is reserved once per compressor.
+	Dictionary dict;
+	std::vector<std::pair<KeyType, char>> decodeDictionary;
+	std::vector<char> decodeString;
+	std::vector<unsigned char> inputScratch;
+	std::vector<unsigned char> outputScratch;
+
+	/// Codes are little endian, which is what writing them natively gave on every target.
+	template <class Sink>
+	static void putCode(Sink& sink, KeyType code)
 	{
-		addHeader(os);
-		Dictionary dict;
+		sink.put(static_cast<unsigned char>(code));
+		sink.put(static_cast<unsigned char>(code >> 8));
+	}
+
+	template <class Source, class Sink>
+	int encode(Source& source, Sink& sink)
+	{
+		dict.resetValues();
 		KeyType index = dictMaxSize;
-		char data;
+		unsigned char data;
 
-		while (is.get(data))
+		while (source.get(data))
 		{
 			const KeyType temp = index;
 
-			if ((index = dict.searchInsert(temp, data)) == dictMaxSize)//string doesn't exist in the dictionary
+			if ((index = dict.searchInsert(temp, static_cast<char>(data))) == dictMaxSize)//string doesn't exist in the dictionary
 			{	
-				os.write(reinterpret_cast<const char *> (&temp), sizeof (KeyType));
-				index = dict.searchInitials(data);
+				putCode(sink, temp);
+				index = dict.searchInitials(static_cast<char>(data));
 			}
 		}
 
 		if (index != dictMaxSize)
-			os.write(reinterpret_cast<const char *> (&index), sizeof (KeyType));
+			putCode(sink, index);
+
+		return EXIT_SUCCESS;
 	}
 
-	void decompress(std::istream &is, std::ostream &os)
+	template <class Source, class Sink>
+	int decode(Source& source, Sink& sink)
 	{
-		if (!checkHeader(is))
-			return ;
+		std::vector<std::pair<KeyType, char>>& dictionary = decodeDictionary;
+		dictionary.resize(dictMaxSize);
+		decodeString.resize(dictMaxSize);
 
-		std::vector<std::pair<KeyType, char>> dictionary;
+		// The single bytes and the preset never change, so a reset only drops what came after them.
+		size_t baseSize = 0;
+		const int minc = std::numeric_limits<char>::min();
+		const int maxc = std::numeric_limits<char>::max();
 
-		const auto resetDictionary = [&dictionary] {
-			dictionary.clear();
-			dictionary.reserve(dictMaxSize);
+		for (int c = minc; c <= maxc; ++c)
+			dictionary[baseSize++] = { dictMaxSize, static_cast<char> (c) };
 
-			const int minc = std::numeric_limits<char>::min();
-			const int maxc = std::numeric_limits<char>::max();
-
-			for (int c = minc; c <= maxc; ++c)
-				dictionary.push_back({ dictMaxSize, static_cast<char> (c) });
-		};
-
-		const auto rebuildString = [&dictionary](KeyType k) -> const std::vector<char> * {
-			static std::vector<char> s; // String
+		if (preset != nullptr)
+		{
+			for (const auto& entry : preset->getEntries())
+				dictionary[baseSize++] = entry;
+		}
 
-			s.clear();
-			s.reserve(dictMaxSize);
+		// Strings are spelled backwards from the end of decodeString, no reversal needed.
+		const auto rebuildString = [&dictionary, this](KeyType k, size_t& length) -> const char * {
+			char* const end = decodeString.data() + decodeString.size();
+			char* s = end; // String
 
 			while (k != dictMaxSize)
 			{
-				s.push_back(dictionary[k].second);
+				*--s = dictionary[k].second;
 				k = dictionary[k].first;
 			}
 
-			std::reverse(s.begin(), s.end());
-			return &s;
+			length = static_cast<size_t>(end - s);
+			return s;
 		};
 
-		resetDictionary();
-
+		size_t size = baseSize; // entries in use
 		KeyType i = dictMaxSize; // Index
-		KeyType k; // Key
+		unsigned char low;
+		unsigned char high;
 
-		while (is.read(reinterpret_cast<char *> (&k), sizeof (KeyType)))
+		while (source.get(low))
 		{
-			if (dictionary.size() == dictMaxSize)
-				resetDictionary();
+			if (!source.get(high))
+				throw std::runtime_error("corrupted compressed file");
+
+			const KeyType k = static_cast<KeyType>(low | high << 8); // Key
+			if (size == dictMaxSize)
+				size = baseSize;
 
-			if (k > dictionary.size())
+			if (k > size || (k == size && i == dictMaxSize))
 				throw std::runtime_error("invalid compressed code");
 
-			const std::vector<char> *s; // String
+			const char *s; // String
+			size_t length;
 
-			if (k == dictionary.size())
+			if (k == size)
 			{
-				dictionary.push_back({ i, rebuildString(i)->front() });
-				s = rebuildString(k);
+				dictionary[size++] = { i, *rebuildString(i, length) };
+				s = rebuildString(k, length);
 			}
 			else
 			{
-				s = rebuildString(k);
+				s = rebuildString(k, length);
 
 				if (i != dictMaxSize)
-					dictionary.push_back({ i, s->front() });
+					dictionary[size++] = { i, *s };
 			}
 
-			os.write(&s->front(), s->size());
+			sink.write(reinterpret_cast<const unsigned char *>(s), length);
 			i = k;
 		}
 
-		if (!is.eof() || is.gcount() != 0)
-			throw std::runtime_error("corrupted compressed file");
+		return EXIT_SUCCESS;
+	}
+
+	struct Encoder
+	{
+		LZWCompressor& codec;
+
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
+		{
+			return codec.encode(source, sink);
+		}
+	};
+
+	struct Decoder
+	{
+		LZWCompressor& codec;
+
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
+		{
+			return codec.decode(source, sink);
+		}
+	};
+
+	int compress(std::istream &is, std::ostream &os)
+	{
+		addHeader(os);
+		if (preset != nullptr)
+		{
+			const std::uint32_t id = preset->getId();
+			os.write(reinterpret_cast<const char *> (&id), sizeof (id));
+		}
+
+		const Encoder encoder = { *this };
+		return runKernel(is, os, inputScratch, outputScratch, encoder);
+	}
+
+	int decompress(std::istream &is, std::ostream &os)
+	{
+		if (!checkHeader(is))
+			return EXIT_FAILURE;
+
+		if (preset != nullptr)
+		{
+			std::uint32_t id = 0;
+			if (!is.read(reinterpret_cast<char *> (&id), sizeof (id)) || id != preset->getId())
+				throw std::runtime_error("preset dictionary mismatch");
+		}
+
+		const Decoder decoder = { *this };
+		return runKernel(is, os, inputScratch, outputScratch, decoder);
 	}
 
 
@@ -218,28 +329,40 @@ class LZWCompressor: public BaseCompression
 		if (!output_file.is_open() || !input_file.is_open())
 			return EXIT_FAILURE;
 
+		return doStreamAction(mode, input_file, output_file);
+	}
+
+	int doStreamAction(Mode mode, std::istream& input_file, std::ostream& output_file)
+	{
+		const std::ios_base::iostate inputExceptions = input_file.exceptions();
+		const std::ios_base::iostate outputExceptions = output_file.exceptions();
+		int result = EXIT_SUCCESS;
+
 		try
 		{
 			input_file.exceptions(std::ios_base::badbit);
 			output_file.exceptions(std::ios_base::badbit | std::ios_base::failbit);
 
 			if (mode == Compress)
-				compress(input_file, output_file);
+				result = compress(input_file, output_file);
 			else if (mode == Decompress)
-				decompress(input_file, output_file);
+				result = decompress(input_file, output_file);
 		}
 		catch (const std::ios_base::failure &f)
 		{
 			std::cout << (std::string("File input/output failure: ") + f.what() + '.', false);
-			return EXIT_FAILURE;
+			result = EXIT_FAILURE;
 		}
 		catch (const std::exception &e)
 		{
 			std::cout << e.what();
-			return EXIT_FAILURE;
+			result = EXIT_FAILURE;
 		}
 
-		return EXIT_SUCCESS;
+		input_file.exceptions(inputExceptions);
+		output_file.exceptions(outputExceptions);
+
+		return result;
 	};
 
 public:
@@ -254,6 +377,102 @@ public:
 		return doFileAction(Mode::Decompress, inputPath, outputPath);
 	}
 
+	int compressStream(std::istream& is, std::ostream& os)
+	{
+		return doStreamAction(Mode::Compress, is, os);
+	}
+
+	int decompressStream(std::istream& is, std::ostream& os)
+	{
+		return doStreamAction(Mode::Decompress, is, os);
+	}
+
+	/// Replays the preset into the encoder dictionary once; every compress() only copies it back.
+	void setPresetDictionary(const PresetDictionary* dictionary)
+	{
+		preset = dictionary;
+		dict.setPreset(dictionary);
+	}
+
+	/// Builds a preset dictionary out of sample payloads. The samples are run through
+	/// a single growing dictionary and the phrases that saved the most bytes are kept,
+	/// together with their prefixes, renumbered in creation order.
+	static void train(const std::vector<std::string>& samples, size_t maxEntries, PresetDictionary& result)
+	{
+		Dictionary dict;
+		std::vector<KeyType> parents(dict.size(), dictMaxSize);
+		std::vector<char> values(dict.size());
+		std::vector<size_t> hits(dict.size(), 0);
+
+		for (const auto& sample : samples)
+		{
+			KeyType index = dictMaxSize;
+
+			for (size_t pos = 0; pos < sample.size() && dict.size() + 1 < dictMaxSize; ++pos)
+			{
+				const KeyType temp = index;
+				const char data = sample[pos];
+
+				if ((index = dict.searchInsert(temp, data)) == dictMaxSize)
+				{
+					hits[temp]++;
+					parents.push_back(temp);
+					values.push_back(data);
+					hits.push_back(0);
+					index = dict.searchInitials(data);
+				}
+			}
+
+			if (index != dictMaxSize)
+				hits[index]++;
+		}
+
+		const size_t roots = 1u << CHAR_BIT;
+		std::vector<size_t> depth(parents.size(), 1);
+		std::vector<std::pair<size_t, size_t>> ranking; // (saved bytes, code)
+
+		for (size_t k = roots; k < parents.size(); ++k)
+		{
+			depth[k] = depth[parents[k]] + 1;
+			if (hits[k] > 1)
+				ranking.push_back({ hits[k] * (depth[k] - 1), k });
+		}
+
+		maxEntries = std::min(maxEntries, static_cast<size_t>(PresetDictionary::MaxEntries));
+		std::sort(ranking.begin(), ranking.end(), std::greater<std::pair<size_t, size_t>>());
+
+		std::vector<bool> keep(parents.size(), false);
+		size_t kept = 0;
+		for (const auto& rank : ranking)
+		{
+			size_t chain = 0;
+			for (size_t k = rank.second; k >= roots && !keep[k]; k = parents[k])
+				chain++;
+
+			if (kept + chain > maxEntries)
+				continue;
+
+			for (size_t k = rank.second; k >= roots && !keep[k]; k = parents[k])
+				keep[k] = true;
+			kept += chain;
+		}
+
+		std::vector<KeyType> renumbered(parents.size(), dictMaxSize);
+		std::vector<PresetDictionary::Entry> entries;
+		for (size_t k = 0; k < parents.size(); ++k)
+		{
+			if (k < roots)
+				renumbered[k] = static_cast<KeyType>(k);
+			else if (keep[k])
+			{
+				renumbered[k] = static_cast<KeyType>(roots + entries.size());
+				entries.push_back({ renumbered[parents[k]], values[k] });
+			}
+		}
+
+		result.setEntries(entries);
+	}
+
 	LZWCompressor(BaseCompression::PrivateKeyType key) :BaseCompression(key)
 	{};
 };
\ No newline at end of file
@@ -0,0 +1,292 @@
+#pragma once
+
+#include "stdafx.h"
+#include "BaseCompression.h"
+#include "BitIO.cpp"
+
+/// Lossless counterpart of AudioCompresser for 16 bit samples. Every block picks the
+/// fixed polynomial predictor (order 0 to 3) with the smallest residuals, and the
+/// residuals are Rice coded:
+///
+///   key | per block: u32 samples | u8 order | u8 rice parameter | u32 payload size | payload
+///       | u32 0 | u8 odd byte present | [odd byte]
+///
+/// Prediction carries over block boundaries, the first block starts from silence.
+class LosslessAudioCompresser : public BaseCompression
+{
+	typedef int16_t SampleType;
+
+	static const size_t BlockSamples = 4096;
+	static const int MaxOrder = 3;
+	static const int MaxRiceParameter = 24;
+	// Quotients from here on are written as an escape and the raw 32 bit value.
+	static const unsigned EscapeQuotient = 32;
+	// The longest code of a residual is the escape; a quotient and its remainder take at
+	// most EscapeQuotient + MaxRiceParameter bits.
+	static const unsigned MaxResidualBits = EscapeQuotient + 32;
+
+	std::vector<SampleType> block;
+	std::vector<std::int32_t> samples; // MaxOrder samples of history, then the block
+	std::vector<std::uint32_t> residuals[MaxOrder + 1];
+	std::vector<unsigned char> payload;
+
+	/// Residuals of every order, zigzag mapped to unsigned. The loops have no dependency
+	/// between iterations, so the compiler vectorizes them.
+	void predict(const std::int32_t* x, size_t count, std::uint64_t (&sums)[MaxOrder + 1])
+	{
+		for (int order = 0; order <= MaxOrder; ++order)
+			residuals[order].resize(count);
+
+		std::uint32_t* r0 = residuals[0].data();
+		std::uint32_t* r1 = residuals[1].data();
+		std::uint32_t* r2 = residuals[2].data();
+		std::uint32_t* r3 = residuals[3].data();
+
+		for (size_t i = 0; i < count; ++i)
+			r0[i] = zigzag(x[i]);
+		for (size_t i = 0; i < count; ++i)
+			r1[i] = zigzag(x[i] - x[i - 1]);
+		for (size_t i = 0; i < count; ++i)
+			r2[i] = zigzag(x[i] - 2 * x[i - 1] + x[i - 2]);
+		for (size_t i = 0; i < count; ++i)
+			r3[i] = zigzag(x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]);
+
+		for (int order = 0; order <= MaxOrder; ++order)
+		{
+			std::uint64_t sum = 0;
+			const std::uint32_t* r = residuals[order].data();
+			for (size_t i = 0; i < count; ++i)
+				sum += r[i];
+
+			sums[order] = sum;
+		}
+	}
+
+	static std::uint32_t zigzag(std::int32_t value)
+	{
+		return (static_cast<std::uint32_t>(value) << 1) ^ static_cast<std::uint32_t>(value >> 31);
+	}
+
+	static std::int32_t unzigzag(std::uint32_t value)
+	{
+		return static_cast<std::int32_t>(value >> 1) ^ -static_cast<std::int32_t>(value & 1);
+	}
+
+	/// Rice parameter close to log2 of the mean residual.
+	static int riceParameter(std::uint64_t sum, size_t count)
+	{
+		int parameter = 0;
+		while (parameter < MaxRiceParameter && (static_cast<std::uint64_t>(count) << (parameter + 1)) <= sum)
+			++parameter;
+
+		return parameter;
+	}
+
+	void writeBlock(size_t count, std::ostream& os)
+	{
+		std::int32_t* x = samples.data() + MaxOrder;
+		for (size_t i = 0; i < count; ++i)
+			x[i] = block[i];
+
+		std::uint64_t sums[MaxOrder + 1];
+		predict(x, count, sums);
+
+		const unsigned char order = static_cast<unsigned char>(std::min_element(sums, sums + MaxOrder + 1) - sums);
+		const unsigned char parameter = static_cast<unsigned char>(riceParameter(sums[order], count));
+
+		payload.clear();
+		VectorSink sink(payload);
+		BitWriter<VectorSink> writer(sink);
+		for (const auto value : residuals[order])
+		{
+			const std::uint32_t quotient = value >> parameter;
+			if (quotient < EscapeQuotient)
+			{
+				writer.write(1, quotient + 1);
+				writer.write(value & ((1u << parameter) - 1), parameter);
+			}
+			else
+			{
+				writer.write(0, EscapeQuotient);
+				writer.write(value, 32);
+			}
+		}
+		writer.flush();
+
+		const std::uint32_t sampleCount = static_cast<std::uint32_t>(count);
+		const std::uint32_t payloadSize = static_cast<std::uint32_t>(payload.size());
+		os.write(reinterpret_cast<const char *>(&sampleCount), sizeof(sampleCount));
+		os.put(static_cast<char>(order));
+		os.put(static_cast<char>(parameter));
+		os.write(reinterpret_cast<const char *>(&payloadSize), sizeof(payloadSize));
+		os.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+
+		keepHistory(count);
+	}
+
+	int readBlock(size_t count, int order, int parameter)
+	{
+		if (count > BlockSamples || order > MaxOrder || parameter > MaxRiceParameter)
+			return EXIT_FAILURE;
+
+		MemorySource source(payload.data(), payload.size());
+		BitReader<MemorySource> reader(source);
+		std::int32_t* x = samples.data() + MaxOrder;
+
+		// Reconstruction feeds on its own output, so unlike prediction it stays serial.
+		for (size_t i = 0; i < count; ++i)
+		{
+			std::uint32_t quotient = 0;
+			std::uint32_t bit = 0;
+			for (; quotient < EscapeQuotient; ++quotient)
+			{
+				if (!reader.read(1, bit))
+					return EXIT_FAILURE;
+				if (bit != 0)
+					break;
+			}
+
+			std::uint32_t value = 0;
+			if (!reader.read(quotient < EscapeQuotient ? parameter : 32, value))
+				return EXIT_FAILURE;
+			if (quotient < EscapeQuotient)
+				value |= quotient << parameter;
+
+			const std::int32_t residual = unzigzag(value);
+
+			switch (order)
+			{
+			case 0:
+				x[i] = residual;
+				break;
+			case 1:
+				x[i] = residual + x[i - 1];
+				break;
+			case 2:
+				x[i] = residual + 2 * x[i - 1] - x[i - 2];
+				break;
+			default:
+				x[i] = residual + 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3];
+				break;
+			}
+
+			block[i] = static_cast<SampleType>(x[i]);
+		}
+
+		keepHistory(count);
+		return EXIT_SUCCESS;
+	}
+
+	void keepHistory(size_t count)
+	{
+		std::copy(samples.begin() + count, samples.begin() + count + MaxOrder, samples.begin());
+	}
+
+public:
+
+	int compressFile(const std::string& inputPath, const std::string& outputPath)
+	{
+		std::ifstream input_file(inputPath, std::ios_base::binary);
+		std::ofstream output_file(outputPath, std::ios_base::binary);
+
+		if (!output_file.is_open() || !input_file.is_open())
+			return EXIT_FAILURE;
+
+		return compressStream(input_file, output_file);
+	}
+
+	int compressStream(std::istream& input_file, std::ostream& output_file)
+	{
+		addHeader(output_file);
+
+		block.resize(BlockSamples);
+		samples.assign(MaxOrder + BlockSamples, 0);
+
+		for (;;)
+		{
+			input_file.read(reinterpret_cast<char *>(block.data()), BlockSamples * sizeof(SampleType));
+			const size_t bytes = static_cast<size_t>(input_file.gcount());
+			const size_t count = bytes / sizeof(SampleType);
+
+			if (count > 0)
+				writeBlock(count, output_file);
+
+			if (bytes < BlockSamples * sizeof(SampleType))
+			{
+				const std::uint32_t end = 0;
+				const bool odd = bytes % sizeof(SampleType) != 0;
+
+				output_file.write(reinterpret_cast<const char *>(&end), sizeof(end));
+				output_file.put(odd ? 1 : 0);
+				if (odd)
+					output_file.put(reinterpret_cast<const char *>(block.data())[bytes - 1]);
+				break;
+			}
+		}
+
+		return output_file ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	int decompressFile(const std::string& inputPath, const std::string& outputPath)
+	{
+		std::ifstream input_file(inputPath, std::ios_base::binary);
+		std::ofstream output_file(outputPath, std::ios_base::binary);
+
+		if (!output_file.is_open() || !input_file.is_open())
+			return EXIT_FAILURE;
+
+		return decompressStream(input_file, output_file);
+	}
+
+	int decompressStream(std::istream& input_file, std::ostream& output_file)
+	{
+		if (!checkHeader(input_file))
+			return EXIT_FAILURE;
+
+		block.resize(BlockSamples);
+		samples.assign(MaxOrder + BlockSamples, 0);
+
+		for (;;)
+		{
+			std::uint32_t count = 0;
+			if (!input_file.read(reinterpret_cast<char *>(&count), sizeof(count)))
+				return EXIT_FAILURE;
+
+			if (count == 0)
+			{
+				char odd = 0;
+				char last = 0;
+				if (!input_file.get(odd) || (odd && !input_file.get(last)))
+					return EXIT_FAILURE;
+
+				if (odd)
+					output_file.put(last);
+				break;
+			}
+
+			unsigned char order = 0;
+			unsigned char parameter = 0;
+			std::uint32_t payloadSize = 0;
+
+			// A payload longer than count escapes is refused before it is allocated.
+			if (!input_file.read(reinterpret_cast<char *>(&order), sizeof(order))
+				|| !input_file.read(reinterpret_cast<char *>(&parameter), sizeof(parameter))
+				|| !input_file.read(reinterpret_cast<char *>(&payloadSize), sizeof(payloadSize))
+				|| count > BlockSamples || payloadSize > (count * MaxResidualBits + 7) / 8)
+				return EXIT_FAILURE;
+
+			payload.resize(payloadSize);
+			if (!input_file.read(reinterpret_cast<char *>(payload.data()), payloadSize)
+				|| readBlock(count, order, parameter) != EXIT_SUCCESS)
+				return EXIT_FAILURE;
+
+			output_file.write(reinterpret_cast<const char *>(block.data()), count * sizeof(SampleType));
+		}
+
+		return output_file ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	LosslessAudioCompresser(BaseCompression::PrivateKeyType key) : BaseCompression(key)
+	{
+	}
+};
\ No newline at end of file
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "stdafx.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// Read-only mapping of a whole file. open() fails for empty files and for files
+/// larger than the address space, callers then read the file as a stream.
+class MappedFile
+{
+public:
+	MappedFile() : view(nullptr), length(0)
+	{
+	}
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	bool open(const std::string& path)
+	{
+		close();
+
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		HANDLE mapping = nullptr;
+		if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && static_cast<std::uint64_t>(size.QuadPart) <= SIZE_MAX)
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+		if (mapping != nullptr)
+		{
+			view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			length = view != nullptr ? static_cast<size_t>(size.QuadPart) : 0;
+			CloseHandle(mapping);
+		}
+
+		CloseHandle(file);
+#else
+		const int file = ::open(path.c_str(), O_RDONLY);
+		if (file < 0)
+			return false;
+
+		struct stat status;
+		if (fstat(file, &status) == 0 && status.st_size > 0 && static_cast<std::uint64_t>(status.st_size) <= SIZE_MAX)
+		{
+			void* mapped = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+			if (mapped != MAP_FAILED)
+			{
+				view = mapped;
+				length = static_cast<size_t>(status.st_size);
+			}
+		}
+
+		::close(file);
+#endif
+
+		return view != nullptr;
+	}
+
+	void close()
+	{
+		if (view == nullptr)
+			return;
+
+#ifdef _WIN32
+		UnmapViewOfFile(view);
+#else
+		munmap(view, length);
+#endif
+
+		view = nullptr;
+		length = 0;
+	}
+
+	const unsigned char* data() const
+	{
+		return static_cast<const unsigned char*>(view);
+	}
+
+	size_t size() const
+	{
+		return length;
+	}
+
+private:
+	void* view;
+	size_t length;
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
\ No newline at end of file
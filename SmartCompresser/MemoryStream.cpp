@@ -0,0 +1,212 @@
+#pragma once
+
+#include "stdafx.h"
+#include <streambuf>
+
+/// Read-only, seekable stream buffer over memory owned by the caller.
+class MemoryInputBuffer : public std::streambuf
+{
+public:
+	MemoryInputBuffer()
+	{
+		attach(nullptr, 0);
+	}
+
+	void attach(const unsigned char* data, size_t size)
+	{
+		char* begin = const_cast<char*>(reinterpret_cast<const char*>(data));
+		setg(begin, begin, begin + size);
+	}
+
+	/// Unread part of the buffer, for readers that work on the memory directly.
+	const unsigned char* current() const
+	{
+		return reinterpret_cast<const unsigned char*>(gptr());
+	}
+
+	size_t remaining() const
+	{
+		return static_cast<size_t>(egptr() - gptr());
+	}
+
+	void skip(size_t count)
+	{
+		setg(eback(), gptr() + std::min(count, remaining()), egptr());
+	}
+
+protected:
+	pos_type seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+	{
+		if (!(which & std::ios_base::in))
+			return pos_type(off_type(-1));
+
+		char* base = dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr();
+		char* target = base + offset;
+
+		if (target < eback() || target > egptr())
+			return pos_type(off_type(-1));
+
+		setg(eback(), target, egptr());
+		return pos_type(off_type(target - eback()));
+	}
+
+	pos_type seekpos(pos_type position, std::ios_base::openmode which) override
+	{
+		return seekoff(off_type(position), std::ios_base::beg, which);
+	}
+};
+
+/// Bytes left to read in is, false when the stream cannot seek. Decoders check the
+/// sizes a header claims against it, so a damaged header fails instead of decoding
+/// padding for as long as it says.
+inline bool remainingInput(std::istream& is, std::uint64_t& remaining)
+{
+	const std::streampos position = is.tellg();
+	if (position == std::streampos(-1))
+		return false;
+
+	const std::streampos end = is.seekg(0, std::ios_base::end) ? is.tellg() : std::streampos(-1);
+	is.clear();
+	is.seekg(position);
+	if (end == std::streampos(-1) || end < position)
+		return false;
+
+	remaining = static_cast<std::uint64_t>(end - position);
+	return true;
+}
+
+/// Write-only stream buffer appending to a caller owned vector. The vector keeps its
+/// capacity between calls, so reusing the same vector does not allocate once warm.
+class VectorOutputBuffer : public std::streambuf
+{
+public:
+	VectorOutputBuffer() : target(nullptr)
+	{
+	}
+
+	/// Starts writing at the beginning of output. The vector is only cleared; the space
+	/// behind the put area is added as writes need it, so attaching a large warm vector
+	/// for a small output does not fill its whole capacity first.
+	void attach(std::vector<unsigned char>& output)
+	{
+		target = &output;
+		target->clear();
+		setp(nullptr, nullptr);
+	}
+
+	/// Trims the vector down to the bytes written and releases it.
+	void detach()
+	{
+		if (target == nullptr)
+			return;
+
+		target->resize(written());
+		target = nullptr;
+		setp(nullptr, nullptr);
+	}
+
+	size_t written() const
+	{
+		return target == nullptr ? 0 : static_cast<size_t>(pptr() - pbase());
+	}
+
+	/// The bytes written so far, valid until the next write.
+	const unsigned char* data() const
+	{
+		return reinterpret_cast<const unsigned char*>(pbase());
+	}
+
+protected:
+	int_type overflow(int_type c) override
+	{
+		if (target == nullptr)
+			return traits_type::eof();
+
+		grow(1);
+
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+		{
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize xsputn(const char* data, std::streamsize count) override
+	{
+		if (target == nullptr)
+			return 0;
+
+		if (static_cast<size_t>(epptr() - pptr()) < static_cast<size_t>(count))
+			grow(static_cast<size_t>(count));
+
+		std::copy(data, data + count, pptr());
+		advance(static_cast<size_t>(count));
+		return count;
+	}
+
+private:
+	static const size_t MinCapacity = 4096;
+
+	std::vector<unsigned char>* target;
+
+	/// Makes room for count more bytes after the ones written, at least doubling the put
+	/// area so a stream of small writes stays amortised constant.
+	void grow(size_t count)
+	{
+		const size_t used = written();
+		target->resize(std::max(std::max(used + count, target->size() * 2), static_cast<size_t>(MinCapacity)));
+
+		char* begin = reinterpret_cast<char*>(target->data());
+		setp(begin, begin + target->size());
+		advance(used);
+	}
+
+	// pbump takes an int, so large offsets are applied in steps.
+	void advance(size_t count)
+	{
+		for (; count > INT_MAX; count -= INT_MAX)
+			pbump(INT_MAX);
+
+		pbump(static_cast<int>(count));
+	}
+};
+
+/// Drops everything written to it and only counts the bytes.
+class NullOutputBuffer : public std::streambuf
+{
+public:
+	NullOutputBuffer() : count(0)
+	{
+	}
+
+	std::uint64_t written() const
+	{
+		return count;
+	}
+
+	/// For writers that bypass the stream and only report how much they produced.
+	void discard(std::uint64_t bytes)
+	{
+		count += bytes;
+	}
+
+protected:
+	int_type overflow(int_type c) override
+	{
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+			++count;
+
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize xsputn(const char*, std::streamsize size) override
+	{
+		count += static_cast<std::uint64_t>(size);
+		return size;
+	}
+
+private:
+	std::uint64_t count;
+};
\ No newline at end of file
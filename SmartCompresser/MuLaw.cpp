@@ -2,6 +2,9 @@
 
 #include "stdafx.h"
 #include "BaseCompression.h"
+#include "BitIO.cpp"
+#include "CpuFeatures.cpp"
+#include <cstring>
 
 class AudioCompresser: public BaseCompression
 {
@@ -9,6 +12,14 @@ class AudioCompresser: public BaseCompression
 	typedef int8_t KeyType;
 	const uint16_t MMAX = 0x1FFF;
 	const uint16_t BIAS = 0x84;//132
+	// Samples are converted a block at a time.
+	static const size_t BlockSamples = 1 << 15;
+
+	std::vector<EncodedType> samples;
+	std::vector<KeyType> keys;
+	std::vector<unsigned char> block;
+	std::vector<unsigned char> inputScratch;
+	std::vector<unsigned char> outputScratch;
 
 	KeyType encode(EncodedType data)
 	{
@@ -56,6 +67,325 @@ class AudioCompresser: public BaseCompression
 		return (sign == 0) ? (result) : (-(result));
 	}
 
+	void encodeBlock(const EncodedType* input, size_t count, KeyType* output)
+	{
+		size_t i = 0;
+
+#ifdef CPU_DISPATCH
+#ifdef CPU_DISPATCH_AVX512
+		if (cpuLevel >= CpuFeatures::Avx512)
+			i = encodeAvx512(input, count, output);
+		else
+#endif
+		if (cpuLevel >= CpuFeatures::Avx2)
+			i = encodeAvx2(input, count, output);
+		else if (cpuLevel >= CpuFeatures::Sse42)
+			i = encodeSse42(input, count, output);
+#endif
+
+		for (; i < count; ++i)
+			output[i] = encode(input[i]);
+	}
+
+	void decodeBlock(const KeyType* input, size_t count, EncodedType* output)
+	{
+		size_t i = 0;
+
+#ifdef CPU_DISPATCH
+#ifdef CPU_DISPATCH_AVX512
+		if (cpuLevel >= CpuFeatures::Avx512)
+			i = decodeAvx512(input, count, output);
+		else
+#endif
+		if (cpuLevel >= CpuFeatures::Avx2)
+			i = decodeAvx2(input, count, output);
+		else if (cpuLevel >= CpuFeatures::Sse42)
+			i = decodeSse42(input, count, output);
+#endif
+
+		for (; i < count; ++i)
+			output[i] = decode(input[i]);
+	}
+
+#ifdef CPU_DISPATCH
+	// The vector kernels do whole vectors and return how many samples they took. Vectors
+	// with a magnitude that overflows when biased go through encode(), which wraps them.
+	// The exponent is the number of thresholds the biased magnitude reaches, the mantissa
+	// comes from a multiply by 2^(15 - exponent) instead of a per lane shift, and decoding
+	// uses (1 << pos) | mantissa << (pos - 4) | 1 << (pos - 5) == (33 + 2 * mantissa) << exponent.
+
+	CPU_TARGET_SSE42 __m128i encodeVector(__m128i data) const
+	{
+		const __m128i magnitude = _mm_min_epi16(_mm_add_epi16(_mm_abs_epi16(data), _mm_set1_epi16(BIAS)), _mm_set1_epi16(MMAX));
+		__m128i exponent = _mm_set1_epi16(2);
+		__m128i scale = _mm_set1_epi16(1 << 13);
+
+		for (int bit = 8; bit <= 12; ++bit)
+		{
+			const __m128i reached = _mm_cmpgt_epi16(magnitude, _mm_set1_epi16(static_cast<short>((1 << bit) - 1)));
+			exponent = _mm_sub_epi16(exponent, reached);
+			scale = _mm_sub_epi16(scale, _mm_and_si128(_mm_srli_epi16(scale, 1), reached));
+		}
+
+		const __m128i mantissa = _mm_and_si128(_mm_mulhi_epu16(magnitude, scale), _mm_set1_epi16(0x0F));
+		const __m128i sign = _mm_and_si128(_mm_srai_epi16(data, 8), _mm_set1_epi16(0x80));
+		const __m128i code = _mm_or_si128(_mm_or_si128(sign, _mm_slli_epi16(exponent, 4)), mantissa);
+
+		return _mm_xor_si128(code, _mm_set1_epi16(0xFF));
+	}
+
+	CPU_TARGET_SSE42 bool inRange(__m128i data) const
+	{
+		const __m128i limit = _mm_set1_epi16(static_cast<short>(SHRT_MAX - BIAS));
+		return _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_max_epu16(_mm_abs_epi16(data), limit), limit)) == 0xFFFF;
+	}
+
+	CPU_TARGET_SSE42 size_t encodeSse42(const EncodedType* input, size_t count, KeyType* output)
+	{
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16)
+		{
+			const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+			const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i + 8));
+
+			if (!inRange(low) || !inRange(high))
+			{
+				for (size_t j = i; j < i + 16; ++j)
+					output[j] = encode(input[j]);
+				continue;
+			}
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_packus_epi16(encodeVector(low), encodeVector(high)));
+		}
+
+		return i;
+	}
+
+	CPU_TARGET_SSE42 size_t decodeSse42(const KeyType* input, size_t count, EncodedType* output) const
+	{
+		// 1 << exponent by byte lookup; the 0x80 in the high index byte clears the high byte.
+		const __m128i powers = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+		const __m128i clearHigh = _mm_set1_epi16(static_cast<short>(0x8000));
+		size_t i = 0;
+
+		for (; i + 8 <= count; i += 8)
+		{
+			const __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(input + i));
+			const __m128i code = _mm_xor_si128(_mm_cvtepu8_epi16(bytes), _mm_set1_epi16(0xFF));
+			const __m128i exponent = _mm_and_si128(_mm_srli_epi16(code, 4), _mm_set1_epi16(7));
+			const __m128i mantissa = _mm_and_si128(code, _mm_set1_epi16(0x0F));
+			const __m128i scale = _mm_shuffle_epi8(powers, _mm_or_si128(exponent, clearHigh));
+
+			const __m128i step = _mm_add_epi16(_mm_add_epi16(mantissa, mantissa), _mm_set1_epi16(33));
+			const __m128i magnitude = _mm_sub_epi16(_mm_mullo_epi16(step, scale), _mm_set1_epi16(BIAS));
+			const __m128i negative = _mm_cmpgt_epi16(code, _mm_set1_epi16(0x7F));
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_sub_epi16(_mm_xor_si128(magnitude, negative), negative));
+		}
+
+		return i;
+	}
+
+	CPU_TARGET_AVX2 __m256i encodeVector(__m256i data) const
+	{
+		const __m256i magnitude = _mm256_min_epi16(_mm256_add_epi16(_mm256_abs_epi16(data), _mm256_set1_epi16(BIAS)), _mm256_set1_epi16(MMAX));
+		__m256i exponent = _mm256_set1_epi16(2);
+		__m256i scale = _mm256_set1_epi16(1 << 13);
+
+		for (int bit = 8; bit <= 12; ++bit)
+		{
+			const __m256i reached = _mm256_cmpgt_epi16(magnitude, _mm256_set1_epi16(static_cast<short>((1 << bit) - 1)));
+			exponent = _mm256_sub_epi16(exponent, reached);
+			scale = _mm256_sub_epi16(scale, _mm256_and_si256(_mm256_srli_epi16(scale, 1), reached));
+		}
+
+		const __m256i mantissa = _mm256_and_si256(_mm256_mulhi_epu16(magnitude, scale), _mm256_set1_epi16(0x0F));
+		const __m256i sign = _mm256_and_si256(_mm256_srai_epi16(data, 8), _mm256_set1_epi16(0x80));
+		const __m256i code = _mm256_or_si256(_mm256_or_si256(sign, _mm256_slli_epi16(exponent, 4)), mantissa);
+
+		return _mm256_xor_si256(code, _mm256_set1_epi16(0xFF));
+	}
+
+	CPU_TARGET_AVX2 bool inRange(__m256i data) const
+	{
+		const __m256i limit = _mm256_set1_epi16(static_cast<short>(SHRT_MAX - BIAS));
+		return _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_max_epu16(_mm256_abs_epi16(data), limit), limit)) == -1;
+	}
+
+	CPU_TARGET_AVX2 size_t encodeAvx2(const EncodedType* input, size_t count, KeyType* output)
+	{
+		size_t i = 0;
+		for (; i + 32 <= count; i += 32)
+		{
+			const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+			const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i + 16));
+
+			if (!inRange(low) || !inRange(high))
+			{
+				for (size_t j = i; j < i + 32; ++j)
+					output[j] = encode(input[j]);
+				continue;
+			}
+
+			// The pack works per 128 bit lane, the permute puts the samples back in order.
+			const __m256i packed = _mm256_packus_epi16(encodeVector(low), encodeVector(high));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), _mm256_permute4x64_epi64(packed, 0xD8));
+		}
+
+		return i;
+	}
+
+	CPU_TARGET_AVX2 size_t decodeAvx2(const KeyType* input, size_t count, EncodedType* output) const
+	{
+		const __m256i powers = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+			1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+		const __m256i clearHigh = _mm256_set1_epi16(static_cast<short>(0x8000));
+		size_t i = 0;
+
+		for (; i + 16 <= count; i += 16)
+		{
+			const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+			const __m256i code = _mm256_xor_si256(_mm256_cvtepu8_epi16(bytes), _mm256_set1_epi16(0xFF));
+			const __m256i exponent = _mm256_and_si256(_mm256_srli_epi16(code, 4), _mm256_set1_epi16(7));
+			const __m256i mantissa = _mm256_and_si256(code, _mm256_set1_epi16(0x0F));
+			const __m256i scale = _mm256_shuffle_epi8(powers, _mm256_or_si256(exponent, clearHigh));
+
+			const __m256i step = _mm256_add_epi16(_mm256_add_epi16(mantissa, mantissa), _mm256_set1_epi16(33));
+			const __m256i magnitude = _mm256_sub_epi16(_mm256_mullo_epi16(step, scale), _mm256_set1_epi16(BIAS));
+			const __m256i negative = _mm256_cmpgt_epi16(code, _mm256_set1_epi16(0x7F));
+
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), _mm256_sub_epi16(_mm256_xor_si256(magnitude, negative), negative));
+		}
+
+		return i;
+	}
+
+#ifdef CPU_DISPATCH_AVX512
+	CPU_TARGET_AVX512 size_t encodeAvx512(const EncodedType* input, size_t count, KeyType* output)
+	{
+		const __m512i limit = _mm512_set1_epi16(static_cast<short>(SHRT_MAX - BIAS));
+		const __m512i one = _mm512_set1_epi16(1);
+		size_t i = 0;
+
+		for (; i + 32 <= count; i += 32)
+		{
+			const __m512i data = _mm512_loadu_si512(input + i);
+			const __m512i absolute = _mm512_abs_epi16(data);
+
+			if (_mm512_cmpgt_epu16_mask(absolute, limit) != 0)
+			{
+				for (size_t j = i; j < i + 32; ++j)
+					output[j] = encode(input[j]);
+				continue;
+			}
+
+			const __m512i magnitude = _mm512_min_epi16(_mm512_add_epi16(absolute, _mm512_set1_epi16(BIAS)), _mm512_set1_epi16(MMAX));
+			__m512i exponent = _mm512_set1_epi16(2);
+			__m512i scale = _mm512_set1_epi16(1 << 13);
+
+			for (int bit = 8; bit <= 12; ++bit)
+			{
+				const __mmask32 reached = _mm512_cmpgt_epi16_mask(magnitude, _mm512_set1_epi16(static_cast<short>((1 << bit) - 1)));
+				exponent = _mm512_mask_add_epi16(exponent, reached, exponent, one);
+				scale = _mm512_mask_srli_epi16(scale, reached, scale, 1);
+			}
+
+			const __m512i mantissa = _mm512_and_si512(_mm512_mulhi_epu16(magnitude, scale), _mm512_set1_epi16(0x0F));
+			const __m512i sign = _mm512_and_si512(_mm512_srai_epi16(data, 8), _mm512_set1_epi16(0x80));
+			const __m512i code = _mm512_or_si512(_mm512_or_si512(sign, _mm512_slli_epi16(exponent, 4)), mantissa);
+
+			_mm512_mask_cvtepi16_storeu_epi8(output + i, ~__mmask32(0), _mm512_xor_si512(code, _mm512_set1_epi16(0xFF)));
+		}
+
+		return i;
+	}
+
+	CPU_TARGET_AVX512 size_t decodeAvx512(const KeyType* input, size_t count, EncodedType* output) const
+	{
+		const long long lanePowers = 0x8040201008040201LL; // the bytes 1, 2, 4 ... 128
+		const __m512i powers = _mm512_set_epi64(0, lanePowers, 0, lanePowers, 0, lanePowers, 0, lanePowers);
+		const __m512i clearHigh = _mm512_set1_epi16(static_cast<short>(0x8000));
+		size_t i = 0;
+
+		for (; i + 32 <= count; i += 32)
+		{
+			const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+			const __m512i code = _mm512_xor_si512(_mm512_cvtepu8_epi16(bytes), _mm512_set1_epi16(0xFF));
+			const __m512i exponent = _mm512_and_si512(_mm512_srli_epi16(code, 4), _mm512_set1_epi16(7));
+			const __m512i mantissa = _mm512_and_si512(code, _mm512_set1_epi16(0x0F));
+			const __m512i scale = _mm512_shuffle_epi8(powers, _mm512_or_si512(exponent, clearHigh));
+
+			const __m512i step = _mm512_add_epi16(_mm512_add_epi16(mantissa, mantissa), _mm512_set1_epi16(33));
+			const __m512i magnitude = _mm512_sub_epi16(_mm512_mullo_epi16(step, scale), _mm512_set1_epi16(BIAS));
+			const __mmask32 negative = _mm512_cmpgt_epi16_mask(code, _mm512_set1_epi16(0x7F));
+
+			_mm512_storeu_si512(output + i, _mm512_mask_sub_epi16(magnitude, negative, _mm512_setzero_si512(), magnitude));
+		}
+
+		return i;
+	}
+#endif
+#endif
+
+	/// The samples are copied out of the span, which may not be aligned for them. A last
+	/// odd byte is not a sample and is dropped.
+	template <class Source, class Sink>
+	int encodeSamples(Source& source, Sink& sink)
+	{
+		samples.resize(BlockSamples);
+		keys.resize(BlockSamples);
+
+		const unsigned char* data;
+		size_t bytes;
+		while ((bytes = source.take(BlockSamples * sizeof(EncodedType), block, data)) > 0)
+		{
+			const size_t count = bytes / sizeof(EncodedType);
+			std::memcpy(samples.data(), data, count * sizeof(EncodedType));
+			encodeBlock(samples.data(), count, keys.data());
+			sink.write(reinterpret_cast<const unsigned char *>(keys.data()), count * sizeof(KeyType));
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	/// Keys are single bytes, so they are decoded straight from the span.
+	template <class Source, class Sink>
+	int decodeSamples(Source& source, Sink& sink)
+	{
+		samples.resize(BlockSamples);
+
+		const unsigned char* data;
+		size_t count;
+		while ((count = source.take(BlockSamples * sizeof(KeyType), block, data)) > 0)
+		{
+			decodeBlock(reinterpret_cast<const KeyType *>(data), count, samples.data());
+			sink.write(reinterpret_cast<const unsigned char *>(samples.data()), count * sizeof(EncodedType));
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	struct Encoder
+	{
+		AudioCompresser& codec;
+
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
+		{
+			return codec.encodeSamples(source, sink);
+		}
+	};
+
+	struct Decoder
+	{
+		AudioCompresser& codec;
+
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
+		{
+			return codec.decodeSamples(source, sink);
+		}
+	};
 
 public:
 
@@ -67,16 +397,15 @@ public:
 		if (!output_file.is_open() || !input_file.is_open())
 			return EXIT_FAILURE;
 
-		addHeader(output_file);
+		return compressStream(input_file, output_file);
+	}
 
-		EncodedType data;
-		while (input_file.read(reinterpret_cast<char *>(&data), sizeof(data)))
-		{
-			KeyType result = encode(data);
-			output_file.write(reinterpret_cast<const char *> (&result), sizeof(KeyType));
-		}
+	int compressStream(std::istream& input_file, std::ostream& output_file)
+	{
+		addHeader(output_file);
 
-		return EXIT_SUCCESS;
+		const Encoder encoder = { *this };
+		return runKernel(input_file, output_file, inputScratch, outputScratch, encoder);
 	}
 
 	int decompressFile(const std::string& inputPath, const std::string& outputPath)
@@ -87,17 +416,16 @@ public:
 		if (!output_file.is_open() || !input_file.is_open())
 			return EXIT_FAILURE;
 
+		return decompressStream(input_file, output_file);
+	}
+
+	int decompressStream(std::istream& input_file, std::ostream& output_file)
+	{
 		if (!checkHeader(input_file))
 			return EXIT_FAILURE;
 
-		KeyType data;
-		while (input_file.read(reinterpret_cast<char*>(&data), sizeof(KeyType)))
-		{
-			EncodedType result = decode(data);
-			output_file.write(reinterpret_cast<char*>(&result), sizeof(EncodedType));
-		}
-
-		return EXIT_SUCCESS;
+		const Decoder decoder = { *this };
+		return runKernel(input_file, output_file, inputScratch, outputScratch, decoder);
 	}
 
 	AudioCompresser(BaseCompression::PrivateKeyType key) :BaseCompression(key)
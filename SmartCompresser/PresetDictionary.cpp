@@ -0,0 +1,128 @@
+#pragma once
+
+#include "stdafx.h"
+
+/// Preset LZW phrases shared between the compressor and the decompressor.
+/// Every entry is a (prefix code, appended char) pair, numbered from 256 upwards,
+/// so the dictionary can be replayed on top of the single-byte roots.
+class PresetDictionary
+{
+public:
+	typedef std::uint16_t CodeType;
+	typedef std::pair<CodeType, char> Entry;
+
+	/// Upper bound of trained entries, the rest of the code space stays adaptive.
+	static const size_t MaxEntries = 16384;
+
+	PresetDictionary() : id(0) {}
+
+	std::uint32_t getId() const
+	{
+		return id;
+	}
+
+	const std::vector<Entry>& getEntries() const
+	{
+		return entries;
+	}
+
+	void setEntries(const std::vector<Entry>& newEntries)
+	{
+		entries = newEntries;
+		id = computeId();
+	}
+
+	int load(const std::string& path)
+	{
+		std::ifstream is(path, std::ios_base::binary);
+		if (!is.is_open())
+			return EXIT_FAILURE;
+
+		char magic[MagicSize];
+		std::uint32_t count = 0;
+
+		is.read(magic, sizeof(magic));
+		is.read(reinterpret_cast<char *>(&id), sizeof(id));
+		is.read(reinterpret_cast<char *>(&count), sizeof(count));
+
+		if (!is || !std::equal(magic, magic + MagicSize, Magic()) || count > MaxEntries)
+			return EXIT_FAILURE;
+
+		entries.resize(count);
+		for (size_t k = 0; k < entries.size(); ++k)
+		{
+			is.read(reinterpret_cast<char *>(&entries[k].first), sizeof(CodeType));
+			is.get(entries[k].second);
+
+			// Prefixes must point to the roots or to an earlier entry.
+			if (entries[k].first >= (1u << CHAR_BIT) + k)
+				return EXIT_FAILURE;
+		}
+
+		if (!is || id != computeId() || hasDuplicates())
+			return EXIT_FAILURE;
+
+		return EXIT_SUCCESS;
+	}
+
+	int save(const std::string& path) const
+	{
+		std::ofstream os(path, std::ios_base::binary);
+		if (!os.is_open())
+			return EXIT_FAILURE;
+
+		const std::uint32_t count = static_cast<std::uint32_t>(entries.size());
+
+		os.write(Magic(), MagicSize);
+		os.write(reinterpret_cast<const char *>(&id), sizeof(id));
+		os.write(reinterpret_cast<const char *>(&count), sizeof(count));
+
+		for (const auto& entry : entries)
+		{
+			os.write(reinterpret_cast<const char *>(&entry.first), sizeof(CodeType));
+			os.put(entry.second);
+		}
+
+		return os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+private:
+	static const size_t MagicSize = 4;
+
+	static const char* Magic()
+	{
+		return "SCD1";
+	}
+
+	std::uint32_t id;
+	std::vector<Entry> entries;
+
+	// The encoder finds a repeated entry already in its dictionary and does not number it,
+	// the decoder does, so every code after it would decode to the wrong phrase.
+	bool hasDuplicates() const
+	{
+		std::vector<Entry> sorted(entries);
+		std::sort(sorted.begin(), sorted.end());
+		return std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end();
+	}
+
+	// FNV-1a over the entries, so the id identifies the content and not the file.
+	std::uint32_t computeId() const
+	{
+		std::uint32_t hash = 2166136261u;
+		const auto mix = [&hash](unsigned char byte)
+		{
+			hash ^= byte;
+			hash *= 16777619u;
+		};
+
+		for (const auto& entry : entries)
+		{
+			mix(static_cast<unsigned char>(entry.first & 0xFF));
+			mix(static_cast<unsigned char>(entry.first >> 8));
+			mix(static_cast<unsigned char>(entry.second));
+		}
+
+		return hash == 0 ? 1 : hash;
+	}
+};
\ No newline at end of file
@@ -1,94 +1,122 @@
+#pragma once
+
 #include "stdafx.h"
-#include "BitFileManager.cpp"
+#include "BitIO.cpp"
 #include "BaseCompression.h"
-#include <bitset>
-#include <cmath>
 
+/// Runs are written as a flag bit, the length byte when the flag is set, and the byte.
 class RLE: public BaseCompression
 {
+	std::vector<unsigned char> inputScratch;
+	std::vector<unsigned char> outputScratch;
 
-public:
-
-	int compressFile(const std::string& inputPath, const std::string& outputPath)
+	template <class Source, class Sink>
+	int encode(Source& source, Sink& sink)
 	{
-		char currentChar;
-		char lastChar;
-		unsigned char frequency = 1;
-		bool first = true;
-
-		std::ifstream file;
-		BitFileManager fileManager(BitFileManager::Mode::Write, outputPath);
-		file.open(inputPath, std::ios_base::binary);
-		addHeader(fileManager.getOStream());
-
-		file.get(lastChar);
-		auto writeData = [&]()
+		BitWriter<Sink> writer(sink);
+		unsigned char currentChar;
+
+		// The source scans the rest of each run at once; longer runs than 255 start a new record.
+		while (source.get(currentChar))
 		{
-			fileManager.write(bool(frequency > 1));
+			const std::uint32_t frequency = 1 + static_cast<std::uint32_t>(source.run(currentChar, 254));
 
 			if (frequency > 1)
-				fileManager.write(frequency);
-			
-			fileManager.write(static_cast<unsigned char>(lastChar));
-		};
-
-		while (file.get(currentChar))
-		{
-			if (lastChar != currentChar || frequency >= 255)
-			{
-				writeData();
-				lastChar = currentChar;
-				frequency = 1;
-			}
+				writer.write(1u << 16 | frequency << 8 | currentChar, 17);
 			else
-				frequency++;
+				writer.write(currentChar, 9);
 		}
 
-		writeData();
+		writer.flush();
+
+		return EXIT_SUCCESS;
+	}
+
+	template <class Source, class Sink>
+	int decode(Source& source, Sink& sink)
+	{
+		BitReader<Source> reader(source);
+		std::uint32_t hasFrecv;
+		std::uint32_t frequency;
+		std::uint32_t currentChar;
+
+		while (reader.read(1, hasFrecv))
+		{
+			frequency = 1;
+			if (hasFrecv && !reader.read(8, frequency))
+				break;
 
-		file.close();
+			// A partial record is the padding of the last byte.
+			if (!reader.read(8, currentChar))
+				break;
+
+			sink.put(static_cast<unsigned char>(currentChar), frequency);
+		}
 
 		return EXIT_SUCCESS;
 	}
 
-	int decompressFile(const std::string& inputPath, const std::string& outputPath)
+	struct Encoder
 	{
-		std::ofstream os;
-		char currentChar;
-		unsigned char frequency;
+		RLE& codec;
 
-		BitFileManager fileManager(BitFileManager::Mode::Read, inputPath);
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
+		{
+			return codec.encode(source, sink);
+		}
+	};
 
-		if (!checkHeader(fileManager.getIStream()))
-			return EXIT_FAILURE;
+	struct Decoder
+	{
+		RLE& codec;
 
-		os.open(outputPath, std::ios_base::binary);
-		
-		bool moreData = true;
-		
-		while (moreData)
+		template <class Source, class Sink>
+		int operator()(Source& source, Sink& sink) const
 		{
-			bool hasFrecv = false;
-			if (fileManager.read(hasFrecv) != EXIT_SUCCESS)
-			{
-				moreData = false;
-				continue;
-			}
-
-			if (hasFrecv == true)
-				fileManager.read(frequency);
-			else frequency = 1;
-
-			if (fileManager.read(reinterpret_cast<unsigned char&>(currentChar)) == EXIT_SUCCESS)
-			{
-				for (unsigned char j = 0; j < frequency; ++j)
-					os.write((char*)&currentChar, sizeof(char));
-			}
+			return codec.decode(source, sink);
 		}
+	};
+
+public:
+
+	int compressFile(const std::string& inputPath, const std::string& outputPath)
+	{
+		std::ifstream file(inputPath, std::ios_base::binary);
+		std::ofstream os(outputPath, std::ios_base::binary);
 
-		os.close();
+		if (!file.is_open() || !os.is_open())
+			return EXIT_FAILURE;
 
-		return EXIT_SUCCESS;
+		return compressStream(file, os);
+	}
+
+	int compressStream(std::istream& file, std::ostream& os)
+	{
+		addHeader(os);
+
+		const Encoder encoder = { *this };
+		return runKernel(file, os, inputScratch, outputScratch, encoder);
+	}
+
+	int decompressFile(const std::string& inputPath, const std::string& outputPath)
+	{
+		std::ifstream is(inputPath, std::ios_base::binary);
+		std::ofstream os(outputPath, std::ios_base::binary);
+
+		if (!is.is_open() || !os.is_open())
+			return EXIT_FAILURE;
+
+		return decompressStream(is, os);
+	}
+
+	int decompressStream(std::istream& is, std::ostream& os)
+	{
+		if (!checkHeader(is))
+			return EXIT_FAILURE;
+
+		const Decoder decoder = { *this };
+		return runKernel(is, os, inputScratch, outputScratch, decoder);
 	}
 
 	RLE(BaseCompression::PrivateKeyType key) : BaseCompression(key)
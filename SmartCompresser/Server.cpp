@@ -0,0 +1,415 @@
+#pragma once
+
+#include "stdafx.h"
+// winsock2.h has to be included before windows.h.
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <cstring>
+#include "WorkerPool.cpp"
+
+/// Long running compression service on a Unix domain socket. A connection sends
+/// requests and reads one response per request, in order:
+///
+///   request:  u8 operation ('C' compress, 'D' decompress) | u8 Worker::Mode | u32 size | payload
+///   response: u8 status (0 on success) | u32 size | payload
+///
+/// Sizes are native endian, both ends are on the same machine. A fixed set of threads
+/// accepts and reads connections, one each, so at most maxConnections are open; more
+/// wait in the listen backlog. Requests from all of them go into one queue, served by a
+/// thread per pool context that lives as long as the server, so contexts stay warm and
+/// no thread is started per request. Worker has to provide compressBuffer(data, size, output,
+/// mode), decompressBuffer(data, size, output) and a static isMode(value). A request
+/// that fails, throws or names no Mode gets a nonzero status; the connection stays open.
+template <class Worker>
+class CompressionServer
+{
+public:
+	typedef typename Worker::Mode Mode;
+
+	explicit CompressionServer(WorkerPool<Worker>& pool, unsigned maxConnections = 64)
+		: pool(pool), listener(InvalidSocket), connections(std::max(1u, maxConnections), InvalidSocket),
+		stopping(false), drained(false)
+	{
+#ifdef _WIN32
+		WSADATA data;
+		WSAStartup(MAKEWORD(2, 2), &data);
+#endif
+	}
+
+	~CompressionServer()
+	{
+		if (listener != InvalidSocket)
+			closeSocket(listener);
+#ifdef _WIN32
+		WSACleanup();
+#endif
+	}
+
+	/// Binds to path, replacing a stale socket file, and serves until stop. Anything else
+	/// at path is left alone and the server does not start.
+	int run(const std::string& path)
+	{
+		sockaddr_un address;
+		std::memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+
+		if (path.empty() || path.size() >= sizeof(address.sun_path) || !removeStaleSocket(path))
+			return EXIT_FAILURE;
+
+		std::memcpy(address.sun_path, path.c_str(), path.size());
+
+		const SocketHandle bound = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (bound == InvalidSocket)
+			return EXIT_FAILURE;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			listener = bound;
+			if (stopping)
+				return EXIT_SUCCESS;
+		}
+
+		if (bind(bound, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+			|| listen(bound, Backlog) != 0)
+			return EXIT_FAILURE;
+
+		std::vector<std::thread> workers;
+		for (unsigned worker = 0; worker < pool.size(); ++worker)
+			workers.push_back(std::thread(&CompressionServer::work, this, worker));
+
+		std::vector<std::thread> acceptors;
+		for (unsigned slot = 0; slot < connections.size(); ++slot)
+			acceptors.push_back(std::thread(&CompressionServer::acceptConnections, this, bound, slot));
+
+		// Acceptors return once stop closed their connections; the requests they queued
+		// before are answered by then, so the workers can go.
+		for (auto& acceptor : acceptors)
+			acceptor.join();
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			drained = true;
+			queued.notify_all();
+		}
+
+		for (auto& worker : workers)
+			worker.join();
+
+		return EXIT_SUCCESS;
+	}
+
+	/// Makes run return: no more connections are accepted, open ones are closed and
+	/// requests already being served are finished first. Safe from any thread.
+	void stop()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (stopping)
+			return;
+
+		stopping = true;
+		if (listener != InvalidSocket)
+			interruptListener();
+
+		for (size_t slot = 0; slot < connections.size(); ++slot)
+		{
+			if (connections[slot] != InvalidSocket)
+				shutdown(connections[slot], ShutdownBoth);
+		}
+	}
+
+	/// run, and stop on SIGINT or SIGTERM (Ctrl+C or closing the console on Windows).
+	int runUntilInterrupted(const std::string& path)
+	{
+#ifdef _WIN32
+		interrupted() = this;
+		SetConsoleCtrlHandler(&CompressionServer::consoleEvent, TRUE);
+		const int result = run(path);
+		SetConsoleCtrlHandler(&CompressionServer::consoleEvent, FALSE);
+		interrupted() = nullptr;
+
+		return result;
+#else
+		// Blocked before any server thread starts, so they all inherit the mask and the
+		// signal is only taken by sigwait.
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		sigset_t previous;
+		pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+		std::thread waiter([this, &signals]()
+		{
+			int signal;
+			sigwait(&signals, &signal);
+			stop();
+		});
+
+		const int result = run(path);
+
+		// Wakes the waiter if the server ended without a signal.
+		pthread_kill(waiter.native_handle(), SIGTERM);
+		waiter.join();
+		pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+
+		return result;
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	typedef SOCKET SocketHandle;
+	static const SocketHandle InvalidSocket = INVALID_SOCKET;
+	static const int SendFlags = 0;
+	static const int ShutdownBoth = SD_BOTH;
+
+	static void closeSocket(SocketHandle handle)
+	{
+		closesocket(handle);
+	}
+
+	/// Winsock only wakes a blocked accept when the socket is closed.
+	void interruptListener()
+	{
+		closeSocket(listener);
+		listener = InvalidSocket;
+	}
+
+	static CompressionServer*& interrupted()
+	{
+		static CompressionServer* server = nullptr;
+		return server;
+	}
+
+	static BOOL WINAPI consoleEvent(DWORD)
+	{
+		if (interrupted())
+			interrupted()->stop();
+
+		return TRUE;
+	}
+
+	/// Unix domain sockets show up as reparse points.
+	static bool removeStaleSocket(const std::string& path)
+	{
+		const DWORD attributes = GetFileAttributesA(path.c_str());
+		if (attributes == INVALID_FILE_ATTRIBUTES)
+			return GetLastError() == ERROR_FILE_NOT_FOUND;
+
+		return (attributes & FILE_ATTRIBUTE_REPARSE_POINT) && !(attributes & FILE_ATTRIBUTE_DIRECTORY)
+			&& DeleteFileA(path.c_str());
+	}
+#else
+	typedef int SocketHandle;
+	static const SocketHandle InvalidSocket = -1;
+	// A client that goes away must not take the server down with SIGPIPE.
+	static const int SendFlags = MSG_NOSIGNAL;
+	static const int ShutdownBoth = SHUT_RDWR;
+
+	static void closeSocket(SocketHandle handle)
+	{
+		close(handle);
+	}
+
+	/// Wakes the threads blocked in accept; the socket is closed by the destructor.
+	void interruptListener()
+	{
+		shutdown(listener, ShutdownBoth);
+	}
+
+	/// lstat, so a symbolic link named path is not followed to what it points at.
+	static bool removeStaleSocket(const std::string& path)
+	{
+		struct stat status;
+		if (lstat(path.c_str(), &status) != 0)
+			return errno == ENOENT;
+
+		return S_ISSOCK(status.st_mode) && unlink(path.c_str()) == 0;
+	}
+#endif
+
+	static const int Backlog = 64;
+	// Larger requests are refused before their payload is allocated.
+	static const std::uint32_t MaxPayload = 1u << 30;
+
+	struct Request
+	{
+		char operation;
+		Mode mode;
+		std::vector<unsigned char> input;
+		std::vector<unsigned char> output; // keeps its capacity across the requests of a connection
+		int result;
+		bool done;
+		std::condition_variable finished;
+	};
+
+	WorkerPool<Worker>& pool;
+	SocketHandle listener;
+	std::vector<SocketHandle> connections; // per acceptor, InvalidSocket while it waits in accept
+
+	std::mutex lock;
+	std::condition_variable queued;
+	std::deque<Request*> queue;
+	bool stopping;
+	bool drained;
+
+	/// Serves one connection at a time in slot until stop.
+	void acceptConnections(SocketHandle bound, unsigned slot)
+	{
+		for (;;)
+		{
+			const SocketHandle connection = accept(bound, nullptr, nullptr);
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (stopping)
+				{
+					if (connection != InvalidSocket)
+						closeSocket(connection);
+					return;
+				}
+
+				if (connection == InvalidSocket)
+					continue;
+
+				connections[slot] = connection;
+			}
+
+			serve(connection);
+
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				connections[slot] = InvalidSocket;
+			}
+
+			closeSocket(connection);
+		}
+	}
+
+	/// Reads requests off one connection until it closes.
+	void serve(SocketHandle connection)
+	{
+		Request request;
+		unsigned char header[2];
+		std::uint32_t size;
+
+		while (receiveAll(connection, header, sizeof(header)) && receiveAll(connection, &size, sizeof(size)) && size <= MaxPayload)
+		{
+			request.input.resize(size);
+			if (!receiveAll(connection, request.input.data(), size))
+				break;
+
+			request.result = EXIT_FAILURE;
+
+			if (Worker::isMode(header[1]))
+			{
+				request.operation = static_cast<char>(header[0]);
+				request.mode = static_cast<Mode>(header[1]);
+				request.done = false;
+
+				std::unique_lock<std::mutex> guard(lock);
+				queue.push_back(&request);
+				queued.notify_one();
+				request.finished.wait(guard, [&request] { return request.done; });
+			}
+
+			// A decoded output the size field cannot hold fails like any other request.
+			const unsigned char status = request.result == EXIT_SUCCESS && request.output.size() <= UINT32_MAX ? 0 : 1;
+			const std::uint32_t outputSize = status == 0 ? static_cast<std::uint32_t>(request.output.size()) : 0;
+
+			if (!sendAll(connection, &status, sizeof(status)) || !sendAll(connection, &outputSize, sizeof(outputSize))
+				|| !sendAll(connection, request.output.data(), outputSize))
+				break;
+		}
+	}
+
+	/// Serves queued requests with the context of one pool worker until run is done.
+	void work(unsigned index)
+	{
+		Worker& worker = pool.context(index);
+
+		for (;;)
+		{
+			Request* request;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				queued.wait(guard, [this] { return !queue.empty() || drained; });
+				if (queue.empty())
+					return;
+
+				request = queue.front();
+				queue.pop_front();
+			}
+
+			const unsigned char* data = request->input.data();
+			const size_t size = request->input.size();
+
+			// Damaged input must cost one request its answer, not the whole server.
+			try
+			{
+				if (request->operation == 'C')
+					request->result = worker.compressBuffer(data, size, request->output, request->mode);
+				else if (request->operation == 'D')
+					request->result = worker.decompressBuffer(data, size, request->output);
+				else
+					request->result = EXIT_FAILURE;
+			}
+			catch (const std::exception&)
+			{
+				request->result = EXIT_FAILURE;
+			}
+
+			std::lock_guard<std::mutex> guard(lock);
+			request->done = true;
+			request->finished.notify_one();
+		}
+	}
+
+	static bool receiveAll(SocketHandle connection, void* data, size_t size)
+	{
+		char* position = static_cast<char*>(data);
+		while (size > 0)
+		{
+			const int chunk = static_cast<int>(std::min<size_t>(size, 1 << 20));
+			const int received = static_cast<int>(recv(connection, position, chunk, 0));
+			if (received <= 0)
+				return false;
+
+			position += received;
+			size -= received;
+		}
+
+		return true;
+	}
+
+	static bool sendAll(SocketHandle connection, const void* data, size_t size)
+	{
+		const char* position = static_cast<const char*>(data);
+		while (size > 0)
+		{
+			const int chunk = static_cast<int>(std::min<size_t>(size, 1 << 20));
+			const int sent = static_cast<int>(send(connection, position, chunk, SendFlags));
+			if (sent <= 0)
+				return false;
+
+			position += sent;
+			size -= sent;
+		}
+
+		return true;
+	}
+};
\ No newline at end of file
@@ -2,87 +2,124 @@
 //
 
 #include "stdafx.h"
-#include "BitFileManager.cpp"
+#include "Server.cpp"
 #include "LZW.cpp"
 #include "RLE.cpp"
 #include "MuLaw.cpp"
 #include <ctime>
+#include <chrono>
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+// The value windows.h gives it, so both builds exit with the same code.
+#define ERROR_BAD_ARGUMENTS 160
+#endif
 #include <string>
 #include "Huffman.cpp"
+#include "WorkerPool.cpp"
+#include "Archive.cpp"
+#include "MemoryStream.cpp"
+#include "Histogram.cpp"
+#include "Stored.cpp"
+#include "BlockContainer.cpp"
+#include "Dedup.cpp"
+#include "BWT.cpp"
+#include "LosslessAudio.cpp"
+#include "ContextHuffman.cpp"
+#include "MappedFile.cpp"
+#include "Checksum.cpp"
+#include "CpuFeatures.cpp"
 
 class SmartCompresser
 {
 	size_t MIN_SIZE = 1024 * 160;
-	std::string tempFileName = "file.tmp";
-	std::string compressedtempFileName = "fileCompressed.tmp";
+	// Samples at least this close to 8 bits per byte go to the stored codec untried.
+	double STORED_ENTROPY = 7.9;
+	// Samples with at least this share of printable ASCII and whitespace count as text.
+	double TEXT_SHARE = 0.95;
 
-	const char HuffmanKey = static_cast<char>(1);
+	// Huffman streams of the first releases, with the table of '0' and '1' characters.
+	const char LegacyHuffmanKey = static_cast<char>(1);
 	const char RleKey = static_cast<char>(2);
 	const char LzwKey = static_cast<char>(3);
 	const char MuLawKey = static_cast<char>(4);
-	
-	int smartCompress(const std::string& input, const std::string& output)
-	{
-		std::ifstream is(input, std::ios_base::binary);
-		std::ofstream os(tempFileName, std::ios_base::binary);
+	const char LzwPresetKey = static_cast<char>(5);
+	const char StoredKey = static_cast<char>(6);
+	const char BlockKey = static_cast<char>(7);
+	const char DedupKey = static_cast<char>(8);
+	const char BwtKey = static_cast<char>(9);
+	const char LosslessAudioKey = static_cast<char>(10);
+	const char ContextHuffmanKey = static_cast<char>(11);
+	const char HuffmanKey = static_cast<char>(12);
 
-		if (!is.is_open() || !os.is_open())
-			return EXIT_FAILURE;
-		std::streampos fsize = 0;
+	std::unique_ptr<PresetDictionary> presetDictionary;
 
-		fsize = is.tellg();
-		is.seekg(0, std::ios::end);
-		fsize = is.tellg() - fsize;
+	// Codec contexts live as long as the compresser, so a batch worker pays for
+	// their allocations once instead of once per file.
+	RLE rle;
+	AudioCompresser audioComp;
+	Huffman huffman;
+	LZWCompressor lzw;
+	LZWCompressor lzwPreset;
+	Stored stored;
+	BurrowsWheeler bwt;
+	LosslessAudioCompresser losslessAudio;
+	ContextHuffman contextHuffman;
+	DedupEncoder dedupEncoder;
+	DedupDecoder dedupDecoder;
+	bool deduplicate;
+	Crc32c crc;
+	bool checksums;
 
-		if (fsize < MIN_SIZE)
-		{
-			is.close();
-			return compressFile(input, output, LempelZivWelch);
-		}
+	// Stream adapters and scratch space of the in-memory API, reused by every call.
+	MemoryInputBuffer inputBuffer;
+	VectorOutputBuffer outputBuffer;
+	std::istream inputStream;
+	std::ostream outputStream;
+	std::vector<unsigned char> sampleBuffer;
+	std::vector<unsigned char> trialBuffer;
+	std::vector<unsigned char> trialDecoded;
+	std::vector<unsigned char> blockInput;
+	std::vector<unsigned char> blockOutput;
+	MappedFile mappedInput;
+	MemoryInputBuffer mappedBuffer;
 
-		is.seekg(MIN_SIZE / 2, std::ios::beg);
-		size_t nbytes = 0;
-		char data;
-		while (is.get(data) && nbytes < MIN_SIZE / 2)
+	/// Maps the input when possible, so codecs read it in place; otherwise it is opened
+	/// as a file stream.
+	bool openInput(const std::string& path, std::ifstream& file, std::istream& is)
+	{
+		if (mappedInput.open(path))
 		{
-			os << data;
-			nbytes++;
+			mappedBuffer.attach(mappedInput.data(), mappedInput.size());
+			is.rdbuf(&mappedBuffer);
+			return true;
 		}
-		os.close();
-
-		size_t minSize = (1<<31);
-		Mode mode;
 
-		auto isMin = [&]()
-		{
-			std::ifstream is(compressedtempFileName, std::ios_base::binary);
-			std::streampos fsize = 0;
-
-			fsize = is.tellg();
-			is.seekg(0, std::ios::end);
-			fsize = is.tellg() - fsize;
+		file.open(path, std::ios_base::binary);
+		is.rdbuf(file.rdbuf());
+		return file.is_open();
+	}
+	
+	int smartCompress(const std::string& input, const std::string& output)
+	{
+		std::ifstream is(input, std::ios_base::binary | std::ios_base::ate);
 
-			if (fsize <= minSize)
-			{
-				minSize = fsize;
-				return true;
-			}
+		if (!is.is_open())
+			return EXIT_FAILURE;
 
-			return false;
-		};
+		const std::streamoff fsize = is.tellg();
+		const bool smallInput = fsize < static_cast<std::streamoff>(MIN_SIZE);
 
-		compressFile(tempFileName, compressedtempFileName, HuffmanCoding);
-		if (isMin())
-			mode = HuffmanCoding;
-		compressFile(tempFileName, compressedtempFileName, LempelZivWelch);
-		if (isMin())
-			mode = LempelZivWelch;
-		compressFile(tempFileName, compressedtempFileName, RunLengthEncoding);
-		if (isMin())
-			mode = RunLengthEncoding;
+		// Small inputs are sampled whole, larger ones from MIN_SIZE / 2 on.
+		is.seekg(smallInput ? 0 : MIN_SIZE / 2, std::ios::beg);
+		sampleBuffer.resize(smallInput ? static_cast<size_t>(fsize) : MIN_SIZE / 2);
+		is.read(reinterpret_cast<char*>(sampleBuffer.data()), sampleBuffer.size());
+		sampleBuffer.resize(static_cast<size_t>(is.gcount()));
+		is.close();
 
-		return compressFile(input, output, mode);
+		return guardedCompress(input, output, smartMode(sampleBuffer.data(), sampleBuffer.size(), smallInput));
 	}
 
 public:
@@ -93,47 +130,109 @@ public:
 		LempelZivWelch,
 		Mulaw,
 		HuffmanCoding,
-		Smart
+		Smart,
+		NoCompression,
+		BlockSorting,
+		LosslessAudio,
+		ContextHuffmanCoding
+	};
+
+	/// Whether value names a Mode, for modes that arrive as raw bytes.
+	static bool isMode(unsigned value)
+	{
+		return value <= ContextHuffmanCoding;
+	}
+
+	enum Objective
+	{
+		Ratio,
+		EncodeSpeed,
+		DecodeSpeed
 	};
+
+	SmartCompresser()
+		: rle(RleKey), audioComp(MuLawKey), huffman(HuffmanKey), lzw(LzwKey), lzwPreset(LzwPresetKey), stored(StoredKey),
+		bwt(BwtKey), losslessAudio(LosslessAudioKey),
+		contextHuffman(ContextHuffmanKey), deduplicate(false), checksums(false), inputStream(&inputBuffer), outputStream(&outputBuffer), objective(Ratio), targetMbps(0)
+	{
+	}
+
+	/// What Smart mode optimizes for; targetMbps (0 for none) is the minimum throughput
+	/// a codec must reach on the sample to be considered.
+	void setObjective(Objective newObjective, double newTargetMbps)
+	{
+		objective = newObjective;
+		targetMbps = newTargetMbps;
+	}
+
+	/// Runs the deduplication stage in front of the codec; it streams, only the index of
+	/// the chunks seen so far is kept in memory.
+	void setDeduplication(bool enabled)
+	{
+		deduplicate = enabled;
+	}
+
+	/// Compresses files as block containers with a CRC32C per block and over the whole
+	/// input, checked when they are decompressed.
+	void setChecksums(bool enabled)
+	{
+		checksums = enabled;
+	}
+
 	int compressFile(const std::string& input, const std::string& output, Mode mode)
 	{
-		RLE rle(RleKey);
-		AudioCompresser audioComp(MuLawKey);
-		Huffman huffman(HuffmanKey);
-		LZWCompressor lzw(LzwKey);
+		if (checksums)
+			return compressChecksummed(input, output, mode);
 
-		switch (mode)
-		{
-		case RunLengthEncoding:
-				return rle.compressFile(input, output);
-		case LempelZivWelch:
-				return lzw.compressFile(input, output);
-		case Mulaw:
-				return audioComp.compressFile(input, output);
-		case HuffmanCoding:
-				return huffman.compressFile(input, output);
-		case Smart:
-				return smartCompress(input, output);
-		}
+		if (mode == Smart)
+			return smartCompress(input, output);
+
+		std::ifstream file;
+		std::istream is(nullptr);
+		std::ofstream os(output, std::ios_base::binary);
+
+		if (!openInput(input, file, is) || !os.is_open())
+			return EXIT_FAILURE;
+
+		const int result = compressStream(is, os, mode);
+		mappedInput.close();
+		return result;
 	}
 
-	int decompressFile(const std::string& input, const std::string& output)
+	int compressStream(std::istream& is, std::ostream& os, Mode mode)
 	{
-		RLE rle(RleKey);
-		AudioCompresser audioComp(MuLawKey);
-		Huffman huffman(HuffmanKey);
-		LZWCompressor lzw(LzwKey);
-		Mode mode;
+		if (!deduplicate)
+			return codecCompress(is, os, mode);
 
-		std::ifstream is(input, std::ios_base::binary);
-		std::ofstream os(tempFileName, std::ios_base::binary);
+		// The codec reads the records while the stage cuts them from is.
+		std::istream records(&dedupEncoder);
+		dedupEncoder.attach(is);
 
-		if (!is.is_open() || !os.is_open())
+		os.put(DedupKey);
+		const int result = codecCompress(records, os, mode);
+		return dedupEncoder.detach() && result == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	int decompressFile(const std::string& input, const std::string& output)
+	{
+		std::ifstream file;
+		std::istream is(nullptr);
+		// Open for reading too: deduplicated streams copy their references from the output.
+		std::fstream os(output, std::ios_base::binary | std::ios_base::in | std::ios_base::out | std::ios_base::trunc);
+
+		if (!openInput(input, file, is) || !os.is_open())
 			return EXIT_FAILURE;
-		
-		char data;
-		is.get(data);
-		is.close();
+
+		const int result = decompressStream(is, os);
+		mappedInput.close();
+		return result;
+	}
+
+	/// Picks the decoder from the key byte, which is left in the stream for the codec to check.
+	int decompressStream(std::istream& is, std::ostream& os)
+	{
+		Mode mode = Smart;
+		const char data = static_cast<char>(is.peek());
 
 		if (data == RleKey)
 			mode = RunLengthEncoding;
@@ -141,65 +240,1011 @@ public:
 			mode = Mulaw;
 		if (data == HuffmanKey)
 			mode = HuffmanCoding;
-		if (data == LzwKey)
+		if (data == LzwKey || data == LzwPresetKey)
 			mode = LempelZivWelch;
+		if (data == StoredKey)
+			mode = NoCompression;
+		if (data == BwtKey)
+			mode = BlockSorting;
+		if (data == LosslessAudioKey)
+			mode = LosslessAudio;
+		if (data == ContextHuffmanKey)
+			mode = ContextHuffmanCoding;
+
+		if (data == BlockKey)
+			return decompressContainer(is, os);
+		if (data == DedupKey)
+			return decompressDeduplicated(is, os);
+		if (data == LegacyHuffmanKey)
+			return huffman.decompressLegacy(is, os);
+
+		if (data == LzwPresetKey && !presetDictionary)
+		{
+			std::cout << "A preset dictionary is required to decompress this file" << std::endl;
+			return EXIT_FAILURE;
+		}
 
 		switch (mode)
 		{
 		case RunLengthEncoding:
-			return rle.decompressFile(input, output);
+			return rle.decompressStream(is, os);
 		case LempelZivWelch:
-			return lzw.decompressFile(input, output);
+			return data == LzwPresetKey ? lzwPreset.decompressStream(is, os) : lzw.decompressStream(is, os);
 		case Mulaw:
-			return audioComp.decompressFile(input, output);
+			return audioComp.decompressStream(is, os);
 		case HuffmanCoding:
-			return huffman.decompressFile(input, output);
+			return huffman.decompressStream(is, os);
+		case NoCompression:
+			return stored.decompressStream(is, os);
+		case BlockSorting:
+			return bwt.decompressStream(is, os);
+		case LosslessAudio:
+			return losslessAudio.decompressStream(is, os);
+		case ContextHuffmanCoding:
+			return contextHuffman.decompressStream(is, os);
+		case Smart: // no codec has this key
+			break;
+		}
+
+		return EXIT_FAILURE;
+	}
+
+	/// Compresses what input has past the raw size container already holds and adds it as
+	/// new blocks, so a growing log is only read and compressed once. A missing container
+	/// is created, with checksums if they are enabled; an existing container keeps the
+	/// format it has. Every block is compressed with mode on its own (Smart picks per block).
+	int appendFile(const std::string& input, const std::string& container, Mode mode)
+	{
+		std::ifstream is(input, std::ios_base::binary | std::ios_base::ate);
+		if (!is.is_open())
+			return EXIT_FAILURE;
+
+		std::fstream fs(container, std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+		BlockContainer index;
+		const bool created = !fs.is_open();
+
+		if (created)
+		{
+			fs.open(container, std::ios_base::binary | std::ios_base::in | std::ios_base::out | std::ios_base::trunc);
+			if (!fs.is_open())
+				return EXIT_FAILURE;
+
+			fs.put(BlockKey);
+			if (checksums)
+				index.enableChecksums();
+		}
+		else if (fs.peek() != BlockKey || index.read(fs) != EXIT_SUCCESS)
+		{
+			std::cout << container << " is not a block container" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		const std::uint64_t inputSize = static_cast<std::uint64_t>(is.tellg());
+		const std::uint64_t covered = index.rawSize();
+
+		if (inputSize < covered)
+		{
+			std::cout << input << " is shorter than what the container holds" << std::endl;
+			return EXIT_FAILURE;
 		}
+
+		if (inputSize == covered && !created)
+			return EXIT_SUCCESS;
+
+		// The blocks and a segment listing them go after the old footer, which stays the
+		// end of the file until the new footer is written.
+		const BlockContainer previous = index;
+		is.seekg(static_cast<std::streamoff>(covered), std::ios::beg);
+		fs.clear();
+		fs.seekp(static_cast<std::streamoff>(index.getAppendOffset()), std::ios::beg);
+
+		if (appendBlocks(is, inputSize - covered, fs, index, mode) == EXIT_SUCCESS && index.write(fs) == EXIT_SUCCESS)
+			return EXIT_SUCCESS;
+
+		if (created)
+		{
+			fs.close();
+			std::remove(container.c_str());
+			return EXIT_FAILURE;
+		}
+
+		// Ending in the old footer again, the file reads as it did before.
+		fs.clear();
+		fs.seekp(0, std::ios::end);
+		previous.writeFooter(fs);
+		return EXIT_FAILURE;
+	}
+
+	/// In-memory compression, no filesystem access. The compresser acts as the context:
+	/// codec state, stream adapters and trial space survive between calls, and output
+	/// keeps its capacity, so a warm context does not allocate for LZW, RLE and mu-law.
+	int compressBuffer(const unsigned char* data, size_t size, std::vector<unsigned char>& output, Mode mode)
+	{
+		const bool smart = mode == Smart;
+		if (smart)
+			mode = bufferMode(data, size);
+
+		attachBuffers(data, size, output);
+		int result = compressStream(inputStream, outputStream, mode);
+		outputBuffer.detach();
+
+		if (smart && result == EXIT_SUCCESS && mode != NoCompression && output.size() > size + 1)
+			return compressBuffer(data, size, output, NoCompression);
+
+		return result;
+	}
+
+	/// compressBuffer for a whole file, the way compressFile writes it (a block container
+	/// with checksums when they are enabled), into a seekable os. The member ends at
+	/// os.tellp(): when Smart falls back to storing, it is rewritten over the longer
+	/// attempt.
+	int compressMember(const unsigned char* data, size_t size, std::ostream& os, Mode mode)
+	{
+		MemoryInputBuffer memberInput;
+		std::istream is(&memberInput);
+		memberInput.attach(data, size);
+
+		if (checksums)
+			return writeChecksummed(is, size, os, mode);
+
+		const bool smart = mode == Smart;
+		if (smart)
+			mode = bufferMode(data, size);
+
+		const std::streampos start = os.tellp();
+		const int result = compressStream(is, os, mode);
+
+		if (smart && result == EXIT_SUCCESS && mode != NoCompression
+			&& static_cast<std::uint64_t>(os.tellp() - start) > size + 1)
+		{
+			memberInput.attach(data, size);
+			is.clear();
+			os.seekp(start);
+			return compressStream(is, os, NoCompression);
+		}
+
+		return result;
+	}
+
+	int decompressBuffer(const unsigned char* data, size_t size, std::vector<unsigned char>& output)
+	{
+		attachBuffers(data, size, output);
+		const int result = decompressStream(inputStream, outputStream);
+		outputBuffer.detach();
+
+		return result;
+	}
+
+	/// Decodes without writing anything and checks what the format allows: structure and
+	/// sizes, and the checksums of containers that have them. Block containers are
+	/// checked a block per pool worker.
+	int testFile(const std::string& input, WorkerPool<SmartCompresser>& pool, std::uint64_t& decodedSize)
+	{
+		decodedSize = 0;
+
+		MappedFile mapped;
+		if (!mapped.open(input))
+		{
+			std::ifstream is(input, std::ios_base::binary);
+			return is.is_open() ? testStream(is, decodedSize) : EXIT_FAILURE;
+		}
+
+		if (mapped.data()[0] == static_cast<unsigned char>(BlockKey))
+			return testContainer(mapped.data(), mapped.size(), pool, decodedSize);
+
+		return testBuffer(mapped.data(), mapped.size(), decodedSize);
+	}
+
+	int testBuffer(const unsigned char* data, size_t size, std::uint64_t& decodedSize)
+	{
+		inputBuffer.attach(data, size);
+		inputStream.clear();
+
+		return testStream(inputStream, decodedSize);
+	}
+
+	/// Threads a single codec call may use, 0 means one per hardware thread.
+	void setCodecThreads(unsigned threads)
+	{
+		huffman.setThreads(threads);
+		bwt.setThreads(threads);
+	}
+
+	int loadDictionary(const std::string& path)
+	{
+		std::unique_ptr<PresetDictionary> dictionary(new PresetDictionary());
+		if (dictionary->load(path) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+
+		presetDictionary = std::move(dictionary);
+		lzwPreset.setPresetDictionary(presetDictionary.get());
+		return EXIT_SUCCESS;
+	}
+
+	/// Trains a preset dictionary from the samples listed (one path per line) in sampleList.
+	int trainDictionary(const std::string& sampleList, const std::string& output, size_t maxEntries)
+	{
+		std::ifstream list(sampleList);
+		if (!list.is_open())
+			return EXIT_FAILURE;
+
+		std::vector<std::string> samples;
+		std::string path;
+		while (std::getline(list, path))
+		{
+			if (!path.empty() && path.back() == '\r')
+				path.pop_back();
+			if (path.empty())
+				continue;
+
+			std::ifstream is(path, std::ios_base::binary);
+			if (!is.is_open())
+				return EXIT_FAILURE;
+
+			samples.push_back(std::string(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>()));
+		}
+
+		PresetDictionary dictionary;
+		LZWCompressor::train(samples, maxEntries, dictionary);
+
+		std::cout << "Trained " << dictionary.getEntries().size() << " entries from " << samples.size()
+			<< " samples, dictionary id " << dictionary.getId() << std::endl;
+
+		return dictionary.save(output);
+	}
+
+private:
+
+	struct Trial
+	{
+		Mode mode;
+		size_t size;
+		double encodeMbps;
+		double decodeMbps;
+	};
+
+	Objective objective;
+	double targetMbps;
+
+	/// The selected codec alone, without the deduplication stage.
+	int codecCompress(std::istream& is, std::ostream& os, Mode mode)
+	{
+		switch (mode)
+		{
+		case RunLengthEncoding:
+				return rle.compressStream(is, os);
+		case LempelZivWelch:
+				return presetDictionary ? lzwPreset.compressStream(is, os) : lzw.compressStream(is, os);
+		case Mulaw:
+				return audioComp.compressStream(is, os);
+		case HuffmanCoding:
+				return huffman.compressStream(is, os);
+		case NoCompression:
+				return stored.compressStream(is, os);
+		case BlockSorting:
+				return bwt.compressStream(is, os);
+		case LosslessAudio:
+				return losslessAudio.compressStream(is, os);
+		case ContextHuffmanCoding:
+				return contextHuffman.compressStream(is, os);
+		case Smart: // resolved to a codec by the callers
+				break;
+		}
+
+		return EXIT_FAILURE;
+	}
+
+	/// Compresses with mode, falling back to the stored codec if the output came out larger
+	/// than the input, so Smart mode never expands by more than the key byte.
+	int guardedCompress(const std::string& input, const std::string& output, Mode mode)
+	{
+		const int result = compressFile(input, output, mode);
+		if (result != EXIT_SUCCESS || mode == NoCompression)
+			return result;
+
+		std::ifstream original(input, std::ios_base::binary | std::ios_base::ate);
+		std::ifstream compressed(output, std::ios_base::binary | std::ios_base::ate);
+
+		if (compressed.tellg() > original.tellg() + std::streamoff(1))
+		{
+			compressed.close();
+			return compressFile(input, output, NoCompression);
+		}
+
+		return result;
+	}
+
+	/// Chooses the codec for Smart mode. Near-random samples are stored, small inputs go
+	/// to LZW, everything else is decided by trial compressions of the sample in memory,
+	/// timed both ways and ranked by the objective. Text samples also try order-1 Huffman.
+	Mode smartMode(const unsigned char* sample, size_t sampleSize, bool smallInput)
+	{
+		std::uint64_t counts[Histogram::Symbols];
+		Histogram::count(sample, sampleSize, counts);
+
+		if (Histogram::entropy(counts) >= STORED_ENTROPY)
+			return NoCompression;
+
+		if (smallInput)
+			return LempelZivWelch;
+
+		std::vector<Mode> candidates = { HuffmanCoding, LempelZivWelch, RunLengthEncoding, BlockSorting, LosslessAudio };
+		if (looksLikeText(counts, sampleSize))
+			candidates.push_back(ContextHuffmanCoding);
+
+		std::vector<Trial> trials;
+
+		for (const Mode candidate : candidates)
+		{
+			typedef std::chrono::steady_clock Clock;
+			Trial trial;
+			trial.mode = candidate;
+
+			const Clock::time_point start = Clock::now();
+			attachBuffers(sample, sampleSize, trialBuffer);
+			codecCompress(inputStream, outputStream, candidate);
+			outputBuffer.detach();
+
+			const Clock::time_point encoded = Clock::now();
+			attachBuffers(trialBuffer.data(), trialBuffer.size(), trialDecoded);
+			decompressStream(inputStream, outputStream);
+			outputBuffer.detach();
+
+			const Clock::time_point decoded = Clock::now();
+			trial.size = trialBuffer.size();
+			trial.encodeMbps = megabytesPerSecond(sampleSize, encoded - start);
+			trial.decodeMbps = megabytesPerSecond(sampleSize, decoded - encoded);
+			trials.push_back(trial);
+		}
+
+		return chooseTrial(trials, sampleSize);
+	}
+
+	/// With a target, only the codecs at least that fast (encoding, or decoding for
+	/// DecodeSpeed) compete on size, and if none is fast enough the data is stored.
+	/// Without a target, Ratio takes the smallest output and the speed objectives the
+	/// fastest codec that still shrinks the sample.
+	Mode chooseTrial(const std::vector<Trial>& trials, size_t sampleSize) const
+	{
+		const auto speed = [this](const Trial& trial)
+		{
+			return objective == DecodeSpeed ? trial.decodeMbps : trial.encodeMbps;
+		};
+
+		const Trial* best = nullptr;
+		for (const auto& trial : trials)
+		{
+			if (targetMbps > 0 && speed(trial) < targetMbps)
+				continue;
+
+			if (objective == Ratio || targetMbps > 0)
+			{
+				if (best == nullptr || trial.size <= best->size)
+					best = &trial;
+			}
+			else if (trial.size < sampleSize && (best == nullptr || speed(trial) > speed(*best)))
+				best = &trial;
+		}
+
+		return best == nullptr ? NoCompression : best->mode;
+	}
+
+	bool looksLikeText(const std::uint64_t(&counts)[Histogram::Symbols], size_t size) const
+	{
+		std::uint64_t text = counts['\t'] + counts['\n'] + counts['\r'];
+		for (int c = ' '; c <= '~'; ++c)
+			text += counts[c];
+
+		return size > 0 && text >= TEXT_SHARE * size;
+	}
+
+	static double megabytesPerSecond(size_t bytes, std::chrono::steady_clock::duration elapsed)
+	{
+		const double seconds = std::chrono::duration<double>(elapsed).count();
+		return seconds > 0 ? bytes / seconds / (1024 * 1024) : std::numeric_limits<double>::max();
+	}
+
+	/// Decodes the blocks of an APPEND container in order; is has to be seekable.
+	int decompressContainer(std::istream& is, std::ostream& os)
+	{
+		BlockContainer index;
+		if (index.read(is) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+
+		std::uint32_t streamChecksum = 0;
+
+		for (size_t i = 0; i < index.getBlocks().size(); ++i)
+		{
+			const BlockContainer::Block& block = index.getBlocks()[i];
+
+			is.clear();
+			is.seekg(static_cast<std::streamoff>(block.offset), std::ios::beg);
+			blockInput.resize(static_cast<size_t>(block.compressedSize));
+			is.read(reinterpret_cast<char*>(blockInput.data()), blockInput.size());
+
+			if (!is || decodeBlock(blockInput.data(), blockInput.size(), block, index.hasChecksums(), os) != EXIT_SUCCESS)
+			{
+				if (index.hasChecksums())
+					std::cout << "Checksum mismatch in block " << i << std::endl;
+				return EXIT_FAILURE;
+			}
+
+			streamChecksum = Crc32c::combine(streamChecksum, block.checksum, block.rawSize);
+		}
+
+		if (index.hasChecksums() && streamChecksum != index.getStreamChecksum())
+		{
+			std::cout << "Checksum mismatch over the whole stream" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		return os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/// Decodes one container block to os. Checked blocks are decoded to memory and only
+	/// written once their size and checksum match.
+	int decodeBlock(const unsigned char* data, size_t size, const BlockContainer::Block& block, bool checked, std::ostream& os)
+	{
+		if (size == 0 || data[0] == static_cast<unsigned char>(BlockKey))
+			return EXIT_FAILURE;
+
+		MemoryInputBuffer blockBuffer;
+		std::istream blockStream(&blockBuffer);
+		blockBuffer.attach(data, size);
+
+		if (!checked)
+			return decompressStream(blockStream, os);
+
+		VectorOutputBuffer decodedBuffer;
+		std::ostream decoded(&decodedBuffer);
+		decodedBuffer.attach(blockOutput);
+		const int result = decompressStream(blockStream, decoded);
+		decodedBuffer.detach();
+
+		if (result != EXIT_SUCCESS || blockOutput.size() != block.rawSize
+			|| crc.update(0, blockOutput.data(), blockOutput.size()) != block.checksum)
+			return EXIT_FAILURE;
+
+		os.write(reinterpret_cast<const char*>(blockOutput.data()), blockOutput.size());
+		return os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/// Decodes into a sink that only counts, decodedSize is what came out.
+	int testStream(std::istream& is, std::uint64_t& decodedSize)
+	{
+		NullOutputBuffer sink;
+		std::ostream os(&sink);
+
+		const int result = decompressStream(is, os);
+		decodedSize = sink.written();
+
+		return result;
+	}
+
+	/// Tests a mapped block container, its blocks spread over the pool.
+	int testContainer(const unsigned char* data, size_t size, WorkerPool<SmartCompresser>& pool, std::uint64_t& decodedSize)
+	{
+		MemoryInputBuffer buffer;
+		std::istream is(&buffer);
+		buffer.attach(data, size);
+
+		BlockContainer index;
+		if (index.read(is) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+
+		const std::vector<BlockContainer::Block>& blocks = index.getBlocks();
+		std::vector<std::uint64_t> decoded(blocks.size(), 0);
+		std::vector<char> damaged(blocks.size(), 0);
+
+		pool.run(blocks.size(), [&](SmartCompresser& worker, size_t job)
+		{
+			const BlockContainer::Block& block = blocks[job];
+			NullOutputBuffer sink;
+			std::ostream os(&sink);
+
+			damaged[job] = block.offset > size || block.compressedSize > size - block.offset
+				|| worker.decodeBlock(data + block.offset, static_cast<size_t>(block.compressedSize), block, index.hasChecksums(), os) != EXIT_SUCCESS
+				|| sink.written() != block.rawSize;
+			decoded[job] = sink.written();
+		});
+
+		std::uint32_t streamChecksum = 0;
+		decodedSize = 0;
+		bool valid = true;
+
+		for (size_t i = 0; i < blocks.size(); ++i)
+		{
+			if (damaged[i])
+			{
+				std::cout << "Block " << i << " is damaged" << std::endl;
+				valid = false;
+			}
+
+			decodedSize += decoded[i];
+			streamChecksum = Crc32c::combine(streamChecksum, blocks[i].checksum, blocks[i].rawSize);
+		}
+
+		if (valid && index.hasChecksums() && streamChecksum != index.getStreamChecksum())
+		{
+			std::cout << "Checksum mismatch over the whole stream" << std::endl;
+			valid = false;
+		}
+
+		return valid ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/// Compresses size bytes of is as new blocks of index, written at the current position of os.
+	int appendBlocks(std::istream& is, std::uint64_t size, std::ostream& os, BlockContainer& index, Mode mode)
+	{
+		std::uint32_t streamChecksum = index.getStreamChecksum();
+
+		for (std::uint64_t remaining = size; remaining > 0;)
+		{
+			blockInput.resize(static_cast<size_t>(std::min<std::uint64_t>(remaining, BlockContainer::BlockSize)));
+			is.read(reinterpret_cast<char*>(blockInput.data()), blockInput.size());
+			if (!is)
+				return EXIT_FAILURE;
+
+			std::uint32_t blockChecksum = 0;
+			if (index.hasChecksums())
+				checksumBlock(blockInput.data(), blockInput.size(), blockChecksum, streamChecksum);
+
+			if (compressBuffer(blockInput.data(), blockInput.size(), blockOutput, mode) != EXIT_SUCCESS)
+				return EXIT_FAILURE;
+
+			os.write(reinterpret_cast<const char*>(blockOutput.data()), blockOutput.size());
+			index.addBlock(blockInput.size(), blockOutput.size(), static_cast<char>(blockOutput[0]), blockChecksum);
+			remaining -= blockInput.size();
+		}
+
+		index.setStreamChecksum(streamChecksum);
+		return os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/// Continues the block and the stream checksum one slice at a time, so the second
+	/// one reads the slice from the cache instead of making another pass over memory.
+	void checksumBlock(const unsigned char* data, size_t size, std::uint32_t& blockChecksum, std::uint32_t& streamChecksum) const
+	{
+		const size_t sliceSize = 64 * 1024;
+
+		for (size_t offset = 0; offset < size; offset += sliceSize)
+		{
+			const size_t length = std::min(sliceSize, size - offset);
+			blockChecksum = crc.update(blockChecksum, data + offset, length);
+			streamChecksum = crc.update(streamChecksum, data + offset, length);
+		}
+	}
+
+	/// Writes the whole input as a new block container with checksums.
+	int compressChecksummed(const std::string& input, const std::string& output, Mode mode)
+	{
+		std::ifstream is(input, std::ios_base::binary | std::ios_base::ate);
+		std::ofstream os(output, std::ios_base::binary);
+
+		if (!is.is_open() || !os.is_open())
+			return EXIT_FAILURE;
+
+		const std::uint64_t size = static_cast<std::uint64_t>(is.tellg());
+		is.seekg(0, std::ios::beg);
+
+		return writeChecksummed(is, size, os, mode);
+	}
+
+	/// Writes size bytes of is as a new block container with checksums.
+	int writeChecksummed(std::istream& is, std::uint64_t size, std::ostream& os, Mode mode)
+	{
+		BlockContainer index;
+		index.enableChecksums();
+		os.put(BlockKey);
+
+		if (appendBlocks(is, size, os, index, mode) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+
+		return index.write(os);
+	}
+
+	/// Expands the records while the inner codec decodes them. The stage is only ever
+	/// written in front of a codec, so it cannot be nested.
+	int decompressDeduplicated(std::istream& is, std::ostream& os)
+	{
+		is.get();
+		const char data = static_cast<char>(is.peek());
+		if (data == DedupKey || data == BlockKey)
+			return EXIT_FAILURE;
+
+		std::ostream records(&dedupDecoder);
+		dedupDecoder.attach(os);
+		const int result = decompressStream(is, records);
+
+		return dedupDecoder.detach() == EXIT_SUCCESS && result == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/// The Smart choice for a buffer, from a sample of its middle like compressFile takes.
+	Mode bufferMode(const unsigned char* data, size_t size)
+	{
+		const bool smallInput = size < MIN_SIZE;
+		const size_t sampleOffset = smallInput ? 0 : MIN_SIZE / 2;
+		return smartMode(data + sampleOffset, smallInput ? size : std::min(size - sampleOffset, MIN_SIZE / 2), smallInput);
+	}
+
+	void attachBuffers(const unsigned char* data, size_t size, std::vector<unsigned char>& output)
+	{
+		inputBuffer.attach(data, size);
+		outputBuffer.attach(output);
+		inputStream.clear();
+		outputStream.clear();
 	}
 };
 
+#ifdef _WIN32
 std::string ws2s(const std::wstring& wideString)
 {
 	return std::string(wideString.begin(), wideString.end());
 }
+#endif
 
-int _tmain(int argc, _TCHAR* argv[])
+SmartCompresser::Mode parseMode(const std::string& mode)
+{
+	if (mode == "RLE")
+		return SmartCompresser::RunLengthEncoding;
+	if (mode == "MULAW")
+		return SmartCompresser::Mulaw;
+	if (mode == "LZW")
+		return SmartCompresser::LempelZivWelch;
+	if (mode == "HUFFMAN")
+		return SmartCompresser::HuffmanCoding;
+	if (mode == "STORED")
+		return SmartCompresser::NoCompression;
+	if (mode == "BWT")
+		return SmartCompresser::BlockSorting;
+	if (mode == "AUDIO")
+		return SmartCompresser::LosslessAudio;
+	if (mode == "HUFFMAN1")
+		return SmartCompresser::ContextHuffmanCoding;
+
+	return SmartCompresser::Smart;
+}
+
+std::string fileName(const std::string& path)
+{
+	const size_t separator = path.find_last_of("/\\");
+	return separator == std::string::npos ? path : path.substr(separator + 1);
+}
+
+/// Batch input is either a directory (every regular file in it) or a list file with one path per line.
+std::vector<std::string> listBatchInputs(const std::string& input)
+{
+	std::vector<std::string> files;
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA findData;
+	HANDLE find = FindFirstFileA((input + "/*").c_str(), &findData);
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				files.push_back(input + "/" + findData.cFileName);
+		} while (FindNextFileA(find, &findData));
+
+		FindClose(find);
+		return files;
+	}
+#else
+	if (DIR* directory = opendir(input.c_str()))
+	{
+		while (const dirent* entry = readdir(directory))
+		{
+			const std::string path = input + "/" + entry->d_name;
+			struct stat status;
+			if (stat(path.c_str(), &status) == 0 && S_ISREG(status.st_mode))
+				files.push_back(path);
+		}
+
+		closedir(directory);
+		return files;
+	}
+#endif
+
+	std::ifstream list(input);
+	std::string path;
+	while (std::getline(list, path))
+	{
+		if (!path.empty() && path.back() == '\r')
+			path.pop_back();
+		if (!path.empty())
+			files.push_back(path);
+	}
+
+	return files;
+}
+
+/// Command line settings every SmartCompresser of a run is configured with.
+struct CompresserOptions
+{
+	std::string dictionaryPath;
+	SmartCompresser::Objective objective;
+	double targetMbps;
+	bool deduplicate;
+	bool checksums;
+
+	CompresserOptions() : objective(SmartCompresser::Ratio), targetMbps(0), deduplicate(false), checksums(false)
+	{
+	}
+
+	int configure(SmartCompresser& compresser) const
+	{
+		compresser.setObjective(objective, targetMbps);
+		compresser.setDeduplication(deduplicate);
+		compresser.setChecksums(checksums);
+
+		if (!dictionaryPath.empty() && compresser.loadDictionary(dictionaryPath) != EXIT_SUCCESS)
+		{
+			std::cout << "Invalid dictionary " << dictionaryPath << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+};
+
+WorkerPool<SmartCompresser>::ContextFactory workerFactory(const CompresserOptions& options)
+{
+	return [options](unsigned)
+	{
+		SmartCompresser* compresser = new SmartCompresser();
+		compresser->setCodecThreads(1); // the pool already runs one file per thread
+		options.configure(*compresser);
+		return compresser;
+	};
+}
+
+/// Compresses (or decompresses) every batch input into outputDir on a pool of workers,
+/// each one reusing its own SmartCompresser and the codec contexts inside it.
+int runBatch(const std::string& input, const std::string& outputDir, SmartCompresser::Mode mode, bool decompress,
+	const CompresserOptions& options, unsigned threads)
+{
+	const std::vector<std::string> files = listBatchInputs(input);
+	const std::string extension = ".sc";
+
+	WorkerPool<SmartCompresser> pool(threads, workerFactory(options));
+
+	std::atomic<size_t> failures(0);
+	pool.run(files.size(), [&](SmartCompresser& compresser, size_t job)
+	{
+		const std::string& file = files[job];
+		std::string name = fileName(file);
+		int result;
+
+		if (decompress)
+		{
+			if (name.size() > extension.size() && name.compare(name.size() - extension.size(), extension.size(), extension) == 0)
+				name.resize(name.size() - extension.size());
+			else
+				name += ".out";
+
+			result = compresser.decompressFile(file, outputDir + "/" + name);
+		}
+		else
+			result = compresser.compressFile(file, outputDir + "/" + name + extension, mode);
+
+		if (result != EXIT_SUCCESS)
+		{
+			failures++;
+			std::cout << "Failed: " + file + "\n";
+		}
+	});
+
+	std::cout << "Processed " << files.size() << " files on " << pool.size() << " workers, "
+		<< failures << " failures" << std::endl;
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/// Serves compress and decompress requests on the socket at path until interrupted.
+int runServer(const std::string& path, const CompresserOptions& options, unsigned threads)
+{
+	WorkerPool<SmartCompresser> pool(threads, workerFactory(options));
+	CompressionServer<SmartCompresser> server(pool);
+
+	if (server.runUntilInterrupted(path) != EXIT_SUCCESS)
+	{
+		std::cout << "Cannot listen on " << path << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/// Decodes input (a compressed file, block container or archive) without writing it
+/// out and reports whether it is intact and how fast it decoded.
+int runTest(const std::string& input, const CompresserOptions& options, unsigned threads)
+{
+	WorkerPool<SmartCompresser> pool(threads, workerFactory(options));
+	Archive<SmartCompresser> archive;
+	SmartCompresser compresser;
+
+	if (options.configure(compresser) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	const auto start = std::chrono::steady_clock::now();
+	std::uint64_t decoded = 0;
+
+	const int result = archive.open(input) == EXIT_SUCCESS
+		? archive.test(pool, decoded)
+		: compresser.testFile(input, pool, decoded);
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << (result == EXIT_SUCCESS ? "OK " : "FAILED ") << input << ": " << decoded << " bytes in " << seconds << " s";
+	if (seconds > 0)
+		std::cout << ", " << decoded / seconds / 1000000 << " MB/s";
+	std::cout << std::endl;
+
+	return result;
+}
+
+/// ARCHIVE packs the batch inputs into one archive, LIST prints its directory and
+/// EXTRACT unpacks one member (the mode argument) or all of them (ALL) into outputDir.
+int runArchive(const std::string& command, const std::string& input, const std::string& output, const std::string& mode,
+	const CompresserOptions& options, unsigned threads)
+{
+	WorkerPool<SmartCompresser> pool(threads, workerFactory(options));
+	Archive<SmartCompresser> archive;
+
+	if (command == "ARCHIVE")
+		return Archive<SmartCompresser>::create(output, listBatchInputs(input), parseMode(mode), pool);
+
+	if (archive.open(input) != EXIT_SUCCESS)
+	{
+		std::cout << "Invalid archive " << input << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (command == "LIST")
+	{
+		for (const auto& member : archive.getMembers())
+			std::cout << member.name << " " << member.size << " -> " << member.compressedSize
+				<< " codec " << static_cast<int>(member.codec) << std::endl;
+
+		return EXIT_SUCCESS;
+	}
+
+	if (mode == "ALL")
+		return archive.extractAll(output, pool);
+
+	const Archive<SmartCompresser>::Member* member = archive.find(mode);
+	if (member == nullptr)
+	{
+		std::cout << "No member named " << mode << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return archive.extract(*member, output + "/" + member->name, pool.context(0));
+}
+
+/// Runs one command, arguments as given to main.
+int runCommandLine(const std::vector<std::string>& arguments)
 {
 	time_t ts;
 	time(&ts);
-	if (argc != 5) //input output mode
+	if (arguments.size() < 5) //input output mode cmp [--dict file] [--dict-size entries]
 		return ERROR_BAD_ARGUMENTS;
 
-	std::string input = ws2s(argv[1]);
-	std::string output = ws2s(argv[2]);
-	std::string mode = ws2s(argv[3]);
-	std::string cmp = ws2s(argv[4]);
+	std::string input = arguments[1];
+	std::string output = arguments[2];
+	std::string mode = arguments[3];
+	std::string cmp = arguments[4];
+	CompresserOptions options;
+	size_t dictionarySize = 4096;
+	unsigned threads = 0;
+
+	for (size_t i = 5; i < arguments.size(); i += 2)
+	{
+		std::string option = arguments[i];
+		if (i + 1 >= arguments.size())
+			return ERROR_BAD_ARGUMENTS;
+
+		if (option == "--dict")
+			options.dictionaryPath = arguments[i + 1];
+		else if (option == "--dict-size")
+			dictionarySize = std::stoul(arguments[i + 1]);
+		else if (option == "--target-mbps")
+			options.targetMbps = std::stod(arguments[i + 1]);
+		else if (option == "--objective")
+		{
+			const std::string objective = arguments[i + 1];
+			if (objective == "ratio")
+				options.objective = SmartCompresser::Ratio;
+			else if (objective == "speed")
+				options.objective = SmartCompresser::EncodeSpeed;
+			else if (objective == "decode-speed")
+				options.objective = SmartCompresser::DecodeSpeed;
+			else
+				return ERROR_BAD_ARGUMENTS;
+		}
+		else if (option == "--dedup")
+			options.deduplicate = arguments[i + 1] == "on";
+		else if (option == "--checksum")
+			options.checksums = arguments[i + 1] == "on";
+		else if (option == "--threads")
+			threads = std::stoul(arguments[i + 1]);
+		else if (option == "--cpu") //caps the SIMD kernels at scalar, sse4.2, avx2 or avx512
+		{
+			CpuFeatures::Level level;
+			if (!CpuFeatures::parse(arguments[i + 1], level))
+				return ERROR_BAD_ARGUMENTS;
+			cpuLevel = std::min(cpuLevel, level);
+		}
+		else
+			return ERROR_BAD_ARGUMENTS;
+	}
 
-	
-	std::cout << "Starting compression" << std::endl;
 	SmartCompresser smartCompresser;
 
+	if (cmp == "TRAIN") //input is a list of sample files, output the dictionary
+		return smartCompresser.trainDictionary(input, output, dictionarySize);
+
+	if (cmp == "BATCH" || cmp == "BATCH_DECOMPRESS") //input is a directory or a list of files, output a directory
+		return runBatch(input, output, parseMode(mode), cmp == "BATCH_DECOMPRESS", options, threads);
+
+	if (cmp == "ARCHIVE" || cmp == "LIST" || cmp == "EXTRACT")
+		return runArchive(cmp, input, output, mode, options, threads);
+
+	if (cmp == "TEST") //output and mode are not used
+		return runTest(input, options, threads);
+
+	if (cmp == "SERVE") //input is the socket path, requests carry their own mode
+		return runServer(input, options, threads);
+
+	if (options.configure(smartCompresser) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	std::cout << "Starting compression" << std::endl;
+
+	int result;
 	if (cmp == "DECOMPRESS")
 	{
-		smartCompresser.decompressFile(input, output);
+		result = smartCompresser.decompressFile(input, output);
+	}
+	else if (cmp == "APPEND") //output is the block container, created on first use
+	{
+		result = smartCompresser.appendFile(input, output, parseMode(mode));
 	}
 	else
 	{
-		if (mode == "RLE")
-			smartCompresser.compressFile(input, output, SmartCompresser::RunLengthEncoding);
-		else if (mode == "MULAW")
-			smartCompresser.compressFile(input, output, SmartCompresser::Mulaw);
-		else if (mode == "LZW")
-			smartCompresser.compressFile(input, output, SmartCompresser::LempelZivWelch);
-		else if (mode == "HUFFMAN")
-			smartCompresser.compressFile(input, output, SmartCompresser::HuffmanCoding);
-		else
-			smartCompresser.compressFile(input, output, SmartCompresser::Smart);
+		result = smartCompresser.compressFile(input, output, parseMode(mode));
+	}
+
+	if (result != EXIT_SUCCESS)
+	{
+		std::cout << "Compression failed" << std::endl;
+		return EXIT_FAILURE;
 	}
+
 	std::cout << "Compression finished in ";
 	time_t te; 
 	time(&te);
 	std::cout << te - ts << std::endl;
 
-	return 0;
-}
\ No newline at end of file
+	return EXIT_SUCCESS;
+}
+
+// The test build includes this file for the compresser and supplies its own main.
+#ifndef SMARTCOMPRESSER_NO_MAIN
+#ifdef _WIN32
+int _tmain(int argc, _TCHAR* argv[])
+{
+	std::vector<std::string> arguments;
+	for (int i = 0; i < argc; ++i)
+		arguments.push_back(ws2s(argv[i]));
+
+	return runCommandLine(arguments);
+}
+#else
+int main(int argc, char* argv[])
+{
+	return runCommandLine(std::vector<std::string>(argv, argv + argc));
+}
+#endif
+#endif
\ No newline at end of file
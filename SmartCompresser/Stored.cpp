@@ -0,0 +1,65 @@
+#pragma once
+
+#include "stdafx.h"
+#include "BaseCompression.h"
+
+/// Passthrough codec for incompressible input: the key byte followed by the raw data.
+class Stored : public BaseCompression
+{
+	static const size_t ChunkSize = 64 * 1024;
+
+	std::vector<char> chunk;
+
+	void copy(std::istream& is, std::ostream& os)
+	{
+		chunk.resize(ChunkSize);
+		while (is.read(chunk.data(), chunk.size()) || is.gcount() > 0)
+			os.write(chunk.data(), is.gcount());
+	}
+
+public:
+
+	int compressFile(const std::string& inputPath, const std::string& outputPath)
+	{
+		std::ifstream input_file(inputPath, std::ios_base::binary);
+		std::ofstream output_file(outputPath, std::ios_base::binary);
+
+		if (!output_file.is_open() || !input_file.is_open())
+			return EXIT_FAILURE;
+
+		return compressStream(input_file, output_file);
+	}
+
+	int compressStream(std::istream& is, std::ostream& os)
+	{
+		addHeader(os);
+		copy(is, os);
+
+		return os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	int decompressFile(const std::string& inputPath, const std::string& outputPath)
+	{
+		std::ifstream input_file(inputPath, std::ios_base::binary);
+		std::ofstream output_file(outputPath, std::ios_base::binary);
+
+		if (!output_file.is_open() || !input_file.is_open())
+			return EXIT_FAILURE;
+
+		return decompressStream(input_file, output_file);
+	}
+
+	int decompressStream(std::istream& is, std::ostream& os)
+	{
+		if (!checkHeader(is))
+			return EXIT_FAILURE;
+
+		copy(is, os);
+
+		return os ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	Stored(BaseCompression::PrivateKeyType key) : BaseCompression(key)
+	{
+	}
+};
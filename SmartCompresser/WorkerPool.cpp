@@ -0,0 +1,75 @@
+#pragma once
+
+#include "stdafx.h"
+#include <atomic>
+#include <thread>
+
+/// Calls job(index) for every index in [0, count), each on its own thread (index 0
+/// runs on the caller), and waits for all of them.
+template <class Job>
+void parallelFor(unsigned count, const Job& job)
+{
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < count; ++i)
+		threads.push_back(std::thread(job, i));
+
+	if (count > 0)
+		job(0u);
+
+	for (auto& thread : threads)
+		thread.join();
+}
+
+/// Runs jobs on a fixed number of threads. Every thread owns one Context that is
+/// created once and then reused for all the jobs it picks up, so codec state and
+/// buffers are allocated per thread instead of per job.
+template <class Context>
+class WorkerPool
+{
+public:
+	typedef std::function<Context*(unsigned worker)> ContextFactory;
+	typedef std::function<void(Context& context, size_t job)> Job;
+
+	WorkerPool(unsigned threads, const ContextFactory& factory)
+	{
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+
+		for (unsigned i = 0; i < threads; ++i)
+			contexts.push_back(std::unique_ptr<Context>(factory(i)));
+	}
+
+	unsigned size() const
+	{
+		return static_cast<unsigned>(contexts.size());
+	}
+
+	Context& context(unsigned worker)
+	{
+		return *contexts[worker];
+	}
+
+	/// Calls job(context, index) for every index in [0, jobCount) and waits for all of them.
+	void run(size_t jobCount, const Job& job)
+	{
+		std::atomic<size_t> next(0);
+		const auto work = [&](unsigned worker)
+		{
+			for (size_t index = next++; index < jobCount; index = next++)
+				job(*contexts[worker], index);
+		};
+
+		const unsigned threads = static_cast<unsigned>(std::min<size_t>(contexts.size(), jobCount));
+		std::vector<std::thread> workers;
+		for (unsigned i = 1; i < threads; ++i)
+			workers.push_back(std::thread(work, i));
+
+		work(0);
+
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+private:
+	std::vector<std::unique_ptr<Context>> contexts;
+};
\ No newline at end of file
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "Test.h"
+
+typedef Archive<SmartCompresser> TestArchive;
+
+/// Sample files in a directory of the running test.
+static std::vector<std::string> archiveInputs()
+{
+	const std::string directory = testPath("in");
+	makeDirectory(directory);
+	writeFile(directory + "/text", textSample(200000));
+	writeFile(directory + "/random", randomSample(50000));
+	writeFile(directory + "/empty", Bytes());
+	writeFile(directory + "/audio", audioSample(30000));
+
+	std::vector<std::string> files;
+	files.push_back(directory + "/text");
+	files.push_back(directory + "/random");
+	files.push_back(directory + "/empty");
+	files.push_back(directory + "/audio");
+	return files;
+}
+
+static void checkArchiveRoundTrip(const CompresserOptions& options)
+{
+	const std::vector<std::string> files = archiveInputs();
+	const std::string path = testPath("sca");
+	const std::string outputDir = testPath("out");
+	const std::string single = testPath("one");
+	WorkerPool<SmartCompresser> pool(3, workerFactory(options));
+
+	CHECK(TestArchive::create(path, files, SmartCompresser::Smart, pool) == EXIT_SUCCESS);
+
+	TestArchive archive;
+	CHECK(archive.open(path) == EXIT_SUCCESS);
+	CHECK(archive.getMembers().size() == files.size());
+
+	std::uint64_t decodedSize = 0;
+	CHECK(archive.test(pool, decodedSize) == EXIT_SUCCESS);
+
+	makeDirectory(outputDir);
+	CHECK(archive.extractAll(outputDir, pool) == EXIT_SUCCESS);
+	for (const std::string& file : files)
+	{
+		const std::string name = fileName(file);
+		CHECK(readFile(outputDir + "/" + name) == readFile(file));
+
+		const TestArchive::Member* member = archive.find(name);
+		CHECK(member != nullptr);
+		CHECK(archive.extract(*member, single, pool.context(0)) == EXIT_SUCCESS);
+		CHECK(readFile(single) == readFile(file));
+	}
+}
+
+/// An archive with a single stored member under name.
+static Bytes archiveWithName(const std::string& name)
+{
+	Bytes data;
+	const char* magic = "SCA1";
+	data.insert(data.end(), magic, magic + 4);
+	data.push_back(6);
+	data.push_back('x');
+
+	const std::uint64_t offset = 4;
+	const std::uint64_t size = 1;
+	const std::uint64_t compressedSize = 2;
+	const std::uint64_t directoryOffset = data.size();
+
+	writeValueAt(data, 1, 4);
+	writeValueAt(data, name.size(), 2);
+	data.insert(data.end(), name.begin(), name.end());
+	writeValueAt(data, size, 8);
+	writeValueAt(data, offset, 8);
+	writeValueAt(data, compressedSize, 8);
+	data.push_back(6);
+	writeValueAt(data, directoryOffset, 8);
+	data.insert(data.end(), magic, magic + 4);
+	return data;
+}
+
+TEST(archiveRoundTrip)
+{
+	checkArchiveRoundTrip(CompresserOptions());
+}
+
+TEST(archiveWithChecksumsAndDedup)
+{
+	CompresserOptions options;
+	options.checksums = true;
+	options.deduplicate = true;
+	checkArchiveRoundTrip(options);
+
+	TestArchive archive;
+	CHECK(archive.open(testPath("sca")) == EXIT_SUCCESS);
+	CHECK(archive.find("text")->codec == 7);
+}
+
+TEST(archiveRejectsDuplicateNames)
+{
+	makeDirectory(testPath("a"));
+	makeDirectory(testPath("b"));
+	writeFile(testPath("a") + "/same", textSample(1000));
+	writeFile(testPath("b") + "/same", textSample(2000));
+
+	std::vector<std::string> files;
+	files.push_back(testPath("a") + "/same");
+	files.push_back(testPath("b") + "/same");
+
+	WorkerPool<SmartCompresser> pool(2, workerFactory(CompresserOptions()));
+	CHECK(TestArchive::create(testPath("sca"), files, SmartCompresser::Smart, pool) == EXIT_FAILURE);
+	CHECK(!fileExists(testPath("sca")));
+}
+
+TEST(archiveRemovesPartFiles)
+{
+	// Members go through a part file per worker; none is left behind, whether the
+	// archive is written or not.
+	std::vector<std::string> files = archiveInputs();
+	WorkerPool<SmartCompresser> pool(3, workerFactory(CompresserOptions()));
+	const std::string path = testPath("sca");
+
+	CHECK(TestArchive::create(path, files, SmartCompresser::Smart, pool) == EXIT_SUCCESS);
+	for (unsigned part = 0; part < pool.size(); ++part)
+		CHECK(!fileExists(path + ".part" + std::to_string(part)));
+
+	files.push_back(testPath("missing"));
+	CHECK(TestArchive::create(path, files, SmartCompresser::Smart, pool) == EXIT_FAILURE);
+	CHECK(!fileExists(path));
+	for (unsigned part = 0; part < pool.size(); ++part)
+		CHECK(!fileExists(path + ".part" + std::to_string(part)));
+}
+
+TEST(archiveRejectsUnsafeNames)
+{
+	TestArchive archive;
+	const std::string path = testPath("sca");
+
+	writeFile(path, archiveWithName("safe"));
+	CHECK(archive.open(path) == EXIT_SUCCESS);
+
+	const char* const unsafe[] = { "", ".", "..", "../escape", "a/b", "/absolute", "a\\b", "c:", "x..y" };
+	for (const char* name : unsafe)
+	{
+		writeFile(path, archiveWithName(name));
+		CHECK(archive.open(path) == EXIT_FAILURE);
+	}
+
+	CHECK(!TestArchive::validName(std::string("a\0b", 3)));
+}
+
+TEST(archiveDamaged)
+{
+	const std::vector<std::string> files = archiveInputs();
+	WorkerPool<SmartCompresser> pool(2, workerFactory(CompresserOptions()));
+	const std::string path = testPath("sca");
+	const std::string extracted = testPath("out");
+	CHECK(TestArchive::create(path, files, SmartCompresser::HuffmanCoding, pool) == EXIT_SUCCESS);
+
+	const Bytes archiveBytes = readFile(path);
+	TestArchive archive;
+	CHECK(archive.open(path) == EXIT_SUCCESS);
+	const TestArchive::Member member = *archive.find("text");
+
+	// A member that decodes to less than its recorded size leaves nothing behind.
+	writeFile(path, withValue(archiveBytes, static_cast<size_t>(member.offset) + 3, member.size / 2));
+
+	CHECK(archive.open(path) == EXIT_SUCCESS);
+	std::remove(extracted.c_str());
+	CHECK(archive.extract(*archive.find("text"), extracted, pool.context(0)) == EXIT_FAILURE);
+	CHECK(!fileExists(extracted));
+
+	std::uint64_t decodedSize = 0;
+	CHECK(archive.test(pool, decodedSize) == EXIT_FAILURE);
+
+	// Members may not reach into the directory.
+	const size_t directoryOffset = archiveBytes.size() - 12;
+	for (size_t size = 0; size < archiveBytes.size(); size += 97)
+	{
+		writeFile(path, Bytes(archiveBytes.begin(), archiveBytes.begin() + size));
+		CHECK(archive.open(path) == EXIT_FAILURE);
+	}
+
+	Bytes pastDirectory = archiveBytes;
+	for (size_t i = 0; i < 8; ++i)
+		pastDirectory[directoryOffset + i] = 0;
+	writeFile(path, pastDirectory);
+	CHECK(archive.open(path) == EXIT_FAILURE);
+}
\ No newline at end of file
@@ -0,0 +1,351 @@
+#pragma once
+
+#include "Test.h"
+
+static Bytes compressed(const Bytes& data, SmartCompresser::Mode mode)
+{
+	SmartCompresser compresser;
+	Bytes output;
+	CHECK(compresser.compressBuffer(data.data(), data.size(), output, mode) == EXIT_SUCCESS);
+	return output;
+}
+
+static bool decompressed(const Bytes& data, Bytes& output)
+{
+	SmartCompresser compresser;
+	return compresser.decompressBuffer(data.data(), data.size(), output) == EXIT_SUCCESS;
+}
+
+static void checkRoundTrip(const Bytes& data, SmartCompresser::Mode mode)
+{
+	Bytes output;
+	CHECK(decompressed(compressed(data, mode), output));
+	CHECK(output == data);
+}
+
+/// Every prefix of a valid stream has to decode to an error or to some output, without
+/// hanging or reading past the end. The full stream still has to round trip.
+static void checkTruncations(const Bytes& data, SmartCompresser::Mode mode)
+{
+	const Bytes stream = compressed(data, mode);
+	for (size_t size = 0; size < stream.size(); ++size)
+	{
+		Bytes prefix(stream.begin(), stream.begin() + size);
+		Bytes output;
+		if (decompressed(prefix, output))
+			CHECK(output.size() <= data.size());
+	}
+
+	checkRoundTrip(data, mode);
+}
+
+static void checkCodec(SmartCompresser::Mode mode)
+{
+	checkRoundTrip(Bytes(), mode);
+	checkRoundTrip(Bytes(1, 'x'), mode);
+	checkRoundTrip(Bytes(100000, 'x'), mode);
+	checkRoundTrip(textSample(300000), mode);
+	checkRoundTrip(randomSample(70000), mode);
+}
+
+TEST(rleRoundTrip)
+{
+	checkCodec(SmartCompresser::RunLengthEncoding);
+}
+
+TEST(lzwRoundTrip)
+{
+	checkCodec(SmartCompresser::LempelZivWelch);
+}
+
+TEST(huffmanRoundTrip)
+{
+	checkCodec(SmartCompresser::HuffmanCoding);
+}
+
+TEST(storedRoundTrip)
+{
+	checkCodec(SmartCompresser::NoCompression);
+}
+
+TEST(bwtRoundTrip)
+{
+	checkCodec(SmartCompresser::BlockSorting);
+}
+
+TEST(contextHuffmanRoundTrip)
+{
+	checkCodec(SmartCompresser::ContextHuffmanCoding);
+}
+
+TEST(smartRoundTrip)
+{
+	checkCodec(SmartCompresser::Smart);
+	checkRoundTrip(audioSample(100000), SmartCompresser::Smart);
+}
+
+TEST(losslessAudioRoundTrip)
+{
+	checkRoundTrip(Bytes(), SmartCompresser::LosslessAudio);
+	checkRoundTrip(audioSample(200000), SmartCompresser::LosslessAudio);
+	checkRoundTrip(randomSample(20001), SmartCompresser::LosslessAudio);
+}
+
+TEST(mulawKeepsLength)
+{
+	// mu-law is lossy: the samples come back with the same count and close to the input.
+	const Bytes data = audioSample(100000);
+	Bytes output;
+	CHECK(decompressed(compressed(data, SmartCompresser::Mulaw), output));
+	CHECK(output.size() == data.size());
+}
+
+TEST(rleTruncated)
+{
+	checkTruncations(textSample(2000), SmartCompresser::RunLengthEncoding);
+}
+
+TEST(lzwTruncated)
+{
+	checkTruncations(textSample(2000), SmartCompresser::LempelZivWelch);
+}
+
+TEST(storedTruncated)
+{
+	checkTruncations(textSample(2000), SmartCompresser::NoCompression);
+}
+
+TEST(bwtTruncated)
+{
+	checkTruncations(textSample(2000), SmartCompresser::BlockSorting);
+}
+
+TEST(losslessAudioTruncated)
+{
+	checkTruncations(audioSample(2000), SmartCompresser::LosslessAudio);
+}
+
+/// Overwrites the little endian u64 at offset, the decoded size field of most formats.
+static Bytes withValue(Bytes stream, size_t offset, std::uint64_t value)
+{
+	CHECK(stream.size() >= offset + sizeof(value));
+	for (size_t i = 0; i < sizeof(value); ++i)
+		stream[offset + i] = static_cast<unsigned char>(value >> (8 * i));
+	return stream;
+}
+
+TEST(huffmanTruncated)
+{
+	checkTruncations(textSample(2000), SmartCompresser::HuffmanCoding);
+	checkTruncations(Bytes(2000, 'x'), SmartCompresser::HuffmanCoding);
+}
+
+TEST(huffmanOversizedTotal)
+{
+	// key | u16 symbols | u64 total
+	const Bytes text = compressed(textSample(5000), SmartCompresser::HuffmanCoding);
+	const Bytes run = compressed(Bytes(5000, 'x'), SmartCompresser::HuffmanCoding);
+	const std::uint64_t sizes[] = { 5100, 100000, std::uint64_t(1) << 40, ~std::uint64_t(0) };
+	Bytes output;
+
+	for (std::uint64_t size : sizes)
+	{
+		CHECK(!decompressed(withValue(text, 3, size), output));
+		CHECK(!decompressed(withValue(run, 3, size), output));
+	}
+}
+
+TEST(bwtOversizedPayload)
+{
+	// key | u32 size | u32 primary index | u32 payload size
+	const Bytes stream = compressed(textSample(5000), SmartCompresser::BlockSorting);
+	const std::uint32_t sizes[] = { 9 << 20, 0xF0000000u, 0xFFFFFFFFu };
+	Bytes output;
+
+	for (std::uint32_t size : sizes)
+	{
+		Bytes damaged = stream;
+		for (size_t i = 0; i < sizeof(size); ++i)
+			damaged[9 + i] = static_cast<unsigned char>(size >> (8 * i));
+		CHECK(!decompressed(damaged, output));
+	}
+}
+
+TEST(losslessAudioOversizedPayload)
+{
+	// key | u32 samples | u8 order | u8 rice parameter | u32 payload size
+	const Bytes stream = compressed(audioSample(5000), SmartCompresser::LosslessAudio);
+	const std::uint32_t sizes[] = { 4096 * 8 + 1, 0xF0000000u, 0xFFFFFFFFu };
+	Bytes output;
+
+	for (std::uint32_t size : sizes)
+	{
+		Bytes damaged = stream;
+		for (size_t i = 0; i < sizeof(size); ++i)
+			damaged[7 + i] = static_cast<unsigned char>(size >> (8 * i));
+		CHECK(!decompressed(damaged, output));
+	}
+}
+
+/// A stream in the table layout of key 1: 'a' = 0, 'b' = 10, 'c' = 11, then bits.
+static Bytes legacyHuffman(unsigned char bits)
+{
+	const unsigned char stream[] = { 1, 'a', '0', 'b', '1', '0', 'c', '1', '1', 0, bits };
+	return Bytes(stream, stream + sizeof(stream));
+}
+
+TEST(huffmanLegacyTable)
+{
+	Bytes output;
+
+	// 0 10 11 0 10
+	CHECK(decompressed(legacyHuffman(0x5A), output));
+	CHECK(output == Bytes({ 'a', 'b', 'c', 'a', 'b' }));
+
+	// The two padding bits after 0 10 11 0 decode as two more 'a', as they always did.
+	CHECK(decompressed(legacyHuffman(0x58), output));
+	CHECK(output == Bytes({ 'a', 'b', 'c', 'a', 'a', 'a' }));
+
+	// Without the terminating zero, or with codes that are not prefix free.
+	const Bytes stream = legacyHuffman(0x5A);
+	CHECK(!decompressed(Bytes(stream.begin(), stream.begin() + 9), output));
+	const unsigned char ambiguous[] = { 1, 'a', '0', 'b', '0', '1', 0, 0 };
+	CHECK(!decompressed(Bytes(ambiguous, ambiguous + sizeof(ambiguous)), output));
+
+	// What is written now has its own key.
+	CHECK(compressed(textSample(1000), SmartCompresser::HuffmanCoding)[0] != 1);
+}
+
+TEST(contextHuffmanTruncated)
+{
+	checkTruncations(textSample(2000), SmartCompresser::ContextHuffmanCoding);
+	checkTruncations(Bytes(2000, 'x'), SmartCompresser::ContextHuffmanCoding);
+}
+
+TEST(contextHuffmanOversizedTotal)
+{
+	const Bytes text = compressed(textSample(5000), SmartCompresser::ContextHuffmanCoding);
+	const Bytes run = compressed(Bytes(5000, 'x'), SmartCompresser::ContextHuffmanCoding);
+	const std::uint64_t sizes[] = { 5100, 100000, std::uint64_t(1) << 40, ~std::uint64_t(0) };
+	Bytes output;
+
+	for (std::uint64_t size : sizes)
+	{
+		CHECK(!decompressed(withValue(text, 1, size), output));
+		CHECK(!decompressed(withValue(run, 1, size), output));
+	}
+}
+
+TEST(unknownKeyFails)
+{
+	Bytes output;
+	CHECK(!decompressed(Bytes(), output));
+	CHECK(!decompressed(Bytes(1, 0), output));
+	CHECK(!decompressed(Bytes(10, 0x7F), output));
+}
+
+TEST(outputVectorReused)
+{
+	// A warm output vector keeps its capacity and only ever holds the latest result.
+	SmartCompresser compresser;
+	const Bytes large = randomSample(300000);
+	const Bytes small = textSample(100);
+	Bytes output;
+
+	CHECK(compresser.compressBuffer(large.data(), large.size(), output, SmartCompresser::NoCompression) == EXIT_SUCCESS);
+	const size_t capacity = output.capacity();
+
+	Bytes decoded;
+	CHECK(compresser.compressBuffer(small.data(), small.size(), output, SmartCompresser::NoCompression) == EXIT_SUCCESS);
+	CHECK(output == compressed(small, SmartCompresser::NoCompression));
+	CHECK(output.capacity() == capacity);
+	CHECK(compresser.decompressBuffer(output.data(), output.size(), decoded) == EXIT_SUCCESS);
+	CHECK(decoded == small);
+
+	CHECK(compresser.compressBuffer(large.data(), large.size(), output, SmartCompresser::LempelZivWelch) == EXIT_SUCCESS);
+	CHECK(compresser.decompressBuffer(output.data(), output.size(), decoded) == EXIT_SUCCESS);
+	CHECK(decoded == large);
+}
+
+/// A trained dictionary saved to path and the text it was trained on.
+static Bytes presetSample(const std::string& path)
+{
+	const Bytes text = textSample(20000, 5);
+	std::vector<std::string> samples(1, std::string(text.begin(), text.end()));
+
+	PresetDictionary dictionary;
+	LZWCompressor::train(samples, 2000, dictionary);
+	CHECK(!dictionary.getEntries().empty());
+	CHECK(dictionary.save(path) == EXIT_SUCCESS);
+	return text;
+}
+
+TEST(presetRoundTrip)
+{
+	const Bytes text = presetSample(testPath("dict"));
+	SmartCompresser compresser;
+	CHECK(compresser.loadDictionary(testPath("dict")) == EXIT_SUCCESS);
+
+	// The dictionary is prepared once and has to serve repeated calls.
+	const Bytes data = textSample(50000, 6);
+	Bytes output;
+	Bytes decoded;
+	for (int call = 0; call < 3; ++call)
+	{
+		CHECK(compresser.compressBuffer(data.data(), data.size(), output, SmartCompresser::LempelZivWelch) == EXIT_SUCCESS);
+		CHECK(compresser.decompressBuffer(output.data(), output.size(), decoded) == EXIT_SUCCESS);
+		CHECK(decoded == data);
+	}
+	CHECK(output.size() < compressed(data, SmartCompresser::LempelZivWelch).size());
+
+	// Without the dictionary the stream cannot be decoded.
+	CHECK(!decompressed(output, decoded));
+}
+
+TEST(presetRejectsDuplicates)
+{
+	presetSample(testPath("dict"));
+	PresetDictionary dictionary;
+	CHECK(dictionary.load(testPath("dict")) == EXIT_SUCCESS);
+
+	// Saved with a matching id, so only the repeated entry is wrong.
+	std::vector<PresetDictionary::Entry> entries = dictionary.getEntries();
+	entries.push_back(entries.front());
+	PresetDictionary repeated;
+	repeated.setEntries(entries);
+	CHECK(repeated.save(testPath("repeated")) == EXIT_SUCCESS);
+
+	SmartCompresser compresser;
+	CHECK(compresser.loadDictionary(testPath("repeated")) == EXIT_FAILURE);
+	CHECK(compresser.loadDictionary(testPath("dict")) == EXIT_SUCCESS);
+}
+
+TEST(streamAndMemoryAgree)
+{
+	// Memory input is read in place and other streams through a buffer; both have to give
+	// the same stream, and decode the same way from either side.
+	const SmartCompresser::Mode modes[] = { SmartCompresser::RunLengthEncoding, SmartCompresser::LempelZivWelch,
+		SmartCompresser::HuffmanCoding, SmartCompresser::ContextHuffmanCoding, SmartCompresser::Mulaw,
+		SmartCompresser::LosslessAudio };
+	const Bytes data = audioSample(150001);
+
+	for (SmartCompresser::Mode mode : modes)
+	{
+		SmartCompresser compresser;
+		std::stringstream input(std::string(data.begin(), data.end()));
+		std::stringstream stream;
+		CHECK(compresser.compressStream(input, stream, mode) == EXIT_SUCCESS);
+
+		const std::string packed = stream.str();
+		const Bytes memory = compressed(data, mode);
+		CHECK(Bytes(packed.begin(), packed.end()) == memory);
+
+		std::stringstream decoded;
+		CHECK(compresser.decompressStream(stream, decoded) == EXIT_SUCCESS);
+
+		Bytes output;
+		CHECK(decompressed(memory, output));
+		const std::string streamed = decoded.str();
+		CHECK(Bytes(streamed.begin(), streamed.end()) == output);
+	}
+}
\ No newline at end of file
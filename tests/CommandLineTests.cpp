@@ -0,0 +1,34 @@
+#pragma once
+
+#include "Test.h"
+
+static int runCommand(const std::string& input, const std::string& output, const std::string& mode, const std::string& command)
+{
+	std::vector<std::string> arguments;
+	arguments.push_back("SmartCompresser");
+	arguments.push_back(input);
+	arguments.push_back(output);
+	arguments.push_back(mode);
+	arguments.push_back(command);
+	return runCommandLine(arguments);
+}
+
+TEST(commandLineRoundTrip)
+{
+	const Bytes data = textSample(50000);
+	writeFile("cli.txt", data);
+
+	CHECK(runCommand("cli.txt", "cli.sc", "HUFFMAN", "COMPRESS") == EXIT_SUCCESS);
+	CHECK(runCommand("cli.sc", "cli.out", "-", "DECOMPRESS") == EXIT_SUCCESS);
+	CHECK(readFile("cli.out") == data);
+}
+
+TEST(commandLineReportsFailures)
+{
+	CHECK(runCommand("missing.txt", "missing.sc", "LZW", "COMPRESS") == EXIT_FAILURE);
+	CHECK(runCommand("missing.sc", "missing.out", "-", "DECOMPRESS") == EXIT_FAILURE);
+	CHECK(runCommand("missing.txt", "missing.scb", "LZW", "APPEND") == EXIT_FAILURE);
+
+	writeFile("garbage.sc", Bytes(64, 0x7F));
+	CHECK(runCommand("garbage.sc", "garbage.out", "-", "DECOMPRESS") == EXIT_FAILURE);
+}
\ No newline at end of file
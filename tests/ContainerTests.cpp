@@ -0,0 +1,178 @@
+#pragma once
+
+#include "Test.h"
+
+/// Appends the first size bytes of data to the container, the way a growing log is appended.
+static void appendPrefix(SmartCompresser& compresser, const Bytes& data, size_t size, const std::string& container)
+{
+	writeFile(testPath("log"), Bytes(data.begin(), data.begin() + size));
+	CHECK(compresser.appendFile(testPath("log"), container, SmartCompresser::LempelZivWelch) == EXIT_SUCCESS);
+}
+
+static void checkAppends(bool checksums)
+{
+	// Past one block, so an append adds a partial block and then full ones.
+	const Bytes data = textSample(BlockContainer::BlockSize + 300000);
+	const size_t sizes[] = { 1000, 1000, 250000, data.size() };
+	SmartCompresser compresser;
+	compresser.setChecksums(checksums);
+	WorkerPool<SmartCompresser> pool(2, workerFactory(CompresserOptions()));
+
+	std::remove(testPath("scb").c_str());
+	Bytes before;
+	for (size_t size : sizes)
+	{
+		appendPrefix(compresser, data, size, testPath("scb"));
+
+		// Nothing written by an earlier append is overwritten.
+		const Bytes after = readFile(testPath("scb"));
+		CHECK(after.size() >= before.size());
+		CHECK(std::equal(before.begin(), before.end(), after.begin()));
+		before = after;
+
+		CHECK(compresser.decompressFile(testPath("scb"), testPath("out")) == EXIT_SUCCESS);
+		CHECK(readFile(testPath("out")) == Bytes(data.begin(), data.begin() + size));
+
+		std::uint64_t decodedSize = 0;
+		CHECK(compresser.testFile(testPath("scb"), pool, decodedSize) == EXIT_SUCCESS);
+		CHECK(decodedSize == size);
+	}
+}
+
+TEST(containerAppend)
+{
+	checkAppends(false);
+}
+
+TEST(containerAppendWithChecksums)
+{
+	checkAppends(true);
+}
+
+TEST(containerInterruptedAppend)
+{
+	const Bytes data = textSample(400000);
+	SmartCompresser compresser;
+
+	std::remove(testPath("scb").c_str());
+	appendPrefix(compresser, data, 100000, testPath("scb"));
+	const Bytes first = readFile(testPath("scb"));
+	appendPrefix(compresser, data, data.size(), testPath("scb"));
+	const Bytes second = readFile(testPath("scb"));
+
+	// Cut anywhere in the second append the file does not end in a footer, and the first
+	// container is still whole in front of it.
+	for (size_t size = first.size() + 1; size < second.size(); size += 997)
+	{
+		writeFile(testPath("cut"), Bytes(second.begin(), second.begin() + size));
+		CHECK(compresser.decompressFile(testPath("cut"), testPath("out")) == EXIT_FAILURE);
+	}
+
+	writeFile(testPath("cut"), Bytes(second.begin(), second.begin() + first.size()));
+	CHECK(compresser.decompressFile(testPath("cut"), testPath("out")) == EXIT_SUCCESS);
+	CHECK(readFile(testPath("out")) == Bytes(data.begin(), data.begin() + 100000));
+
+	// Appending the same input again changes nothing.
+	appendPrefix(compresser, data, data.size(), testPath("scb"));
+	CHECK(readFile(testPath("scb")) == second);
+}
+
+TEST(containerAppendGrowsLinearly)
+{
+	// Every append lists only its own blocks, so many small appends cost a constant each.
+	const Bytes data = textSample(60000);
+	SmartCompresser compresser;
+
+	std::remove(testPath("scb").c_str());
+	for (size_t size = 200; size <= data.size(); size += 200)
+		appendPrefix(compresser, data, size, testPath("scb"));
+
+	// A block entry, a segment header and the footer per append, plus the blocks themselves.
+	const size_t appends = data.size() / 200;
+	const Bytes container = readFile(testPath("scb"));
+	CHECK(container.size() < data.size() + appends * 100);
+
+	CHECK(compresser.decompressFile(testPath("scb"), testPath("out")) == EXIT_SUCCESS);
+	CHECK(readFile(testPath("out")) == data);
+}
+
+/// A container as written before the index segments: one index without a back pointer.
+static Bytes legacyContainer(const Bytes& data)
+{
+	const Bytes block = compressed(data, SmartCompresser::LempelZivWelch);
+	Bytes container;
+	container.reserve(block.size() + 64);
+	container.push_back(7);
+	container.insert(container.end(), block.begin(), block.end());
+
+	const std::uint64_t indexOffset = container.size();
+	writeValueAt(container, 1, 4);
+	writeValueAt(container, data.size(), 8);
+	writeValueAt(container, 1, 8);
+	writeValueAt(container, block.size(), 8);
+	container.push_back(block[0]);
+	writeValueAt(container, indexOffset, 8);
+	container.insert(container.end(), { 'S', 'C', 'B', '1' });
+	return container;
+}
+
+TEST(containerReadsLegacyIndex)
+{
+	const Bytes data = textSample(300000);
+	SmartCompresser compresser;
+
+	writeFile(testPath("scb"), legacyContainer(Bytes(data.begin(), data.begin() + 100000)));
+	CHECK(compresser.decompressFile(testPath("scb"), testPath("out")) == EXIT_SUCCESS);
+	CHECK(readFile(testPath("out")) == Bytes(data.begin(), data.begin() + 100000));
+
+	appendPrefix(compresser, data, data.size(), testPath("scb"));
+	CHECK(compresser.decompressFile(testPath("scb"), testPath("out")) == EXIT_SUCCESS);
+	CHECK(readFile(testPath("out")) == data);
+
+	appendPrefix(compresser, data, data.size(), testPath("scb"));
+	CHECK(compresser.decompressFile(testPath("scb"), testPath("out")) == EXIT_SUCCESS);
+	CHECK(readFile(testPath("out")) == data);
+}
+
+TEST(containerDamagedIndex)
+{
+	const Bytes data = textSample(300000);
+	SmartCompresser compresser;
+
+	std::remove(testPath("scb").c_str());
+	appendPrefix(compresser, data, 100000, testPath("scb"));
+	appendPrefix(compresser, data, data.size(), testPath("scb"));
+	const Bytes container = readFile(testPath("scb"));
+
+	// The footer points at the newest segment: one block, then the back pointer.
+	const size_t footer = container.size() - 12;
+	size_t newest = 0;
+	for (size_t i = 0; i < 8; ++i)
+		newest |= static_cast<size_t>(container[footer + i]) << (8 * i);
+
+	const size_t backPointer = newest + 4 + 25;
+	const std::uint64_t pointers[] = { newest, newest + 1, footer, ~std::uint64_t(0) };
+	Bytes output;
+
+	for (std::uint64_t pointer : pointers)
+	{
+		CHECK(!decompressed(withValue(container, backPointer, pointer), output));
+		if (pointer != newest)
+			CHECK(!decompressed(withValue(container, footer, pointer), output));
+	}
+
+	// Blocks that reach past their segment, or start inside the key.
+	const size_t entry = newest + 4;
+	CHECK(!decompressed(withValue(container, entry + 16, std::uint64_t(1) << 63), output));
+	CHECK(!decompressed(withValue(container, entry + 16, newest), output));
+	CHECK(!decompressed(withValue(container, entry + 8, 0), output));
+	CHECK(!decompressed(withValue(container, entry + 8, ~std::uint64_t(0)), output));
+
+	// A count no segment has room for.
+	Bytes count = container;
+	count[newest + 3] = 0x7F;
+	CHECK(!decompressed(count, output));
+
+	CHECK(decompressed(container, output));
+	CHECK(output == data);
+}
\ No newline at end of file
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "Test.h"
+
+/// Random blocks repeated at a distance, with text in between.
+static Bytes repetitiveSample()
+{
+	const Bytes block = randomSample(300000, 7);
+	const Bytes text = textSample(50000, 8);
+	Bytes data;
+
+	for (int copy = 0; copy < 3; ++copy)
+	{
+		data.insert(data.end(), block.begin(), block.end());
+		data.insert(data.end(), text.begin(), text.end());
+	}
+	return data;
+}
+
+static Bytes deduplicated(const Bytes& data, SmartCompresser::Mode mode)
+{
+	SmartCompresser compresser;
+	compresser.setDeduplication(true);
+
+	Bytes output;
+	CHECK(compresser.compressBuffer(data.data(), data.size(), output, mode) == EXIT_SUCCESS);
+	return output;
+}
+
+/// Dedup key, then the records behind the stored codec.
+static Bytes storedRecords()
+{
+	Bytes stream;
+	stream.push_back(8);
+	stream.push_back(6);
+	return stream;
+}
+
+static void addLiteral(Bytes& stream, const Bytes& bytes)
+{
+	stream.push_back(0);
+	writeValueAt(stream, bytes.size(), 4);
+	stream.insert(stream.end(), bytes.begin(), bytes.end());
+}
+
+static void addReference(Bytes& stream, std::uint32_t length, std::uint64_t offset)
+{
+	stream.push_back(1);
+	writeValueAt(stream, length, 4);
+	writeValueAt(stream, offset, 8);
+}
+
+TEST(dedupRoundTrip)
+{
+	const Bytes data = repetitiveSample();
+	const SmartCompresser::Mode modes[] = { SmartCompresser::NoCompression, SmartCompresser::RunLengthEncoding,
+		SmartCompresser::LempelZivWelch, SmartCompresser::HuffmanCoding, SmartCompresser::BlockSorting,
+		SmartCompresser::ContextHuffmanCoding, SmartCompresser::Smart };
+
+	for (SmartCompresser::Mode mode : modes)
+	{
+		Bytes output;
+		CHECK(decompressed(deduplicated(data, mode), output));
+		CHECK(output == data);
+	}
+
+	Bytes output;
+	CHECK(decompressed(deduplicated(Bytes(), SmartCompresser::NoCompression), output));
+	CHECK(output.empty());
+}
+
+TEST(dedupFindsRepeats)
+{
+	const Bytes data = repetitiveSample();
+	const Bytes plain = compressed(data, SmartCompresser::NoCompression);
+	const Bytes stream = deduplicated(data, SmartCompresser::NoCompression);
+
+	// Most of the second and third copies become references.
+	CHECK(stream.size() < plain.size() / 2);
+
+	SmartCompresser compresser;
+	std::uint64_t decodedSize = 0;
+	CHECK(compresser.testBuffer(stream.data(), stream.size(), decodedSize) == EXIT_SUCCESS);
+	CHECK(decodedSize == data.size());
+}
+
+TEST(dedupFiles)
+{
+	// File output is read back for the references.
+	const Bytes data = repetitiveSample();
+	writeFile("dedup.in", data);
+
+	SmartCompresser compresser;
+	compresser.setDeduplication(true);
+	CHECK(compresser.compressFile("dedup.in", "dedup.sc", SmartCompresser::LempelZivWelch) == EXIT_SUCCESS);
+	CHECK(compresser.decompressFile("dedup.sc", "dedup.out") == EXIT_SUCCESS);
+	CHECK(readFile("dedup.out") == data);
+
+	// Past the first block of a container, the output of a block starts inside the file.
+	Bytes large;
+	for (int copy = 0; copy < 5; ++copy)
+		large.insert(large.end(), data.begin(), data.end());
+	writeFile("dedup.large", large);
+
+	std::remove("dedup.scb");
+	CHECK(compresser.appendFile("dedup.large", "dedup.scb", SmartCompresser::NoCompression) == EXIT_SUCCESS);
+	CHECK(compresser.decompressFile("dedup.scb", "dedup.out") == EXIT_SUCCESS);
+	CHECK(readFile("dedup.out") == large);
+
+	compresser.setChecksums(true);
+	CHECK(compresser.compressFile("dedup.in", "dedup.scc", SmartCompresser::HuffmanCoding) == EXIT_SUCCESS);
+	CHECK(compresser.decompressFile("dedup.scc", "dedup.out") == EXIT_SUCCESS);
+	CHECK(readFile("dedup.out") == data);
+}
+
+TEST(dedupDamagedRecords)
+{
+	const Bytes literal(3000, 'a');
+	Bytes output;
+
+	Bytes valid = storedRecords();
+	addLiteral(valid, literal);
+	addReference(valid, 1000, 2000);
+	CHECK(decompressed(valid, output));
+	CHECK(output.size() == 4000);
+
+	Bytes pastOutput = storedRecords();
+	addLiteral(pastOutput, literal);
+	addReference(pastOutput, 1000, 2001);
+	CHECK(!decompressed(pastOutput, output));
+
+	Bytes hugeOffset = storedRecords();
+	addLiteral(hugeOffset, literal);
+	addReference(hugeOffset, 1000, ~std::uint64_t(0));
+	CHECK(!decompressed(hugeOffset, output));
+
+	Bytes empty = storedRecords();
+	addLiteral(empty, Bytes());
+	CHECK(!decompressed(empty, output));
+
+	Bytes oversized = storedRecords();
+	oversized.push_back(0);
+	writeValueAt(oversized, 0xFFFFFFFFu, 4);
+	CHECK(!decompressed(oversized, output));
+
+	Bytes badTag = storedRecords();
+	badTag.push_back(2);
+	CHECK(!decompressed(badTag, output));
+
+	Bytes nested = storedRecords();
+	nested[1] = 8;
+	nested.push_back(6);
+	CHECK(!decompressed(nested, output));
+
+	// Cut between records the stream is only shorter, inside one it is damaged.
+	const size_t boundary = valid.size() - Dedup::ReferenceHeader;
+	for (size_t size = 3; size < valid.size(); ++size)
+		CHECK(decompressed(Bytes(valid.begin(), valid.begin() + size), output) == (size == boundary));
+}
+
+TEST(dedupTruncated)
+{
+	const Bytes data = repetitiveSample();
+	const Bytes stream = deduplicated(Bytes(data.begin(), data.begin() + 5000), SmartCompresser::LempelZivWelch);
+
+	for (size_t size = 0; size < stream.size(); ++size)
+	{
+		Bytes output;
+		if (decompressed(Bytes(stream.begin(), stream.begin() + size), output))
+			CHECK(output.size() <= 5000);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "Test.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// Connects to the server at path, retrying while it starts up.
+static int connectTo(const std::string& path)
+{
+	sockaddr_un address;
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path, path.c_str(), path.size());
+
+	for (int attempt = 0; attempt < 500; ++attempt)
+	{
+		const int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connect(connection, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0)
+			return connection;
+
+		close(connection);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	throw TestFailure("cannot connect to " + path);
+}
+
+static bool exchange(int connection, char operation, unsigned mode, const Bytes& payload, Bytes& response)
+{
+	Bytes request;
+	request.push_back(static_cast<unsigned char>(operation));
+	request.push_back(static_cast<unsigned char>(mode));
+	const std::uint32_t size = static_cast<std::uint32_t>(payload.size());
+	const unsigned char* sizeBytes = reinterpret_cast<const unsigned char*>(&size);
+	request.insert(request.end(), sizeBytes, sizeBytes + sizeof(size));
+	request.insert(request.end(), payload.begin(), payload.end());
+	CHECK(send(connection, request.data(), request.size(), 0) == static_cast<ssize_t>(request.size()));
+
+	unsigned char status = 0;
+	std::uint32_t responseSize = 0;
+	CHECK(recv(connection, &status, 1, MSG_WAITALL) == 1);
+	CHECK(recv(connection, &responseSize, sizeof(responseSize), MSG_WAITALL) == sizeof(responseSize));
+
+	response.resize(responseSize);
+	if (responseSize > 0)
+		CHECK(recv(connection, response.data(), responseSize, MSG_WAITALL) == static_cast<ssize_t>(responseSize));
+
+	return status == 0;
+}
+
+static void serveForever(const std::string& path)
+{
+	WorkerPool<SmartCompresser> pool(2, workerFactory(CompresserOptions()));
+	CompressionServer<SmartCompresser> server(pool);
+	server.run(path);
+}
+
+TEST(serverRoundTrip)
+{
+	// A socket left behind by an earlier run of the test is replaced.
+	const std::string path = "server.sock";
+	std::thread(serveForever, path).detach();
+
+	const Bytes data = textSample(100000);
+	std::vector<std::thread> clients;
+	std::atomic<int> failures(0);
+
+	for (int client = 0; client < 4; ++client)
+	{
+		clients.push_back(std::thread([&]()
+		{
+			try
+			{
+				const int connection = connectTo(path);
+				for (int request = 0; request < 5; ++request)
+				{
+					Bytes packed;
+					Bytes unpacked;
+					CHECK(exchange(connection, 'C', SmartCompresser::LempelZivWelch, data, packed));
+					CHECK(exchange(connection, 'D', SmartCompresser::Smart, packed, unpacked));
+					CHECK(unpacked == data);
+					CHECK(!exchange(connection, 'D', SmartCompresser::Smart, Bytes(3, 0x7F), unpacked));
+				}
+				close(connection);
+			}
+			catch (const std::exception& e)
+			{
+				std::cout << e.what() << std::endl;
+				failures++;
+			}
+		}));
+	}
+
+	for (auto& client : clients)
+		client.join();
+
+	CHECK(failures == 0);
+}
+
+TEST(serverRefusesBadRequests)
+{
+	const std::string path = testPath("sock");
+	std::thread(serveForever, path).detach();
+
+	const int connection = connectTo(path);
+	const Bytes data = textSample(10000);
+	Bytes response;
+
+	CHECK(!exchange(connection, 'C', 0xFF, data, response));
+	CHECK(!exchange(connection, 'C', SmartCompresser::ContextHuffmanCoding + 1, data, response));
+	CHECK(!exchange(connection, 'X', SmartCompresser::Smart, data, response));
+
+	// Every codec key followed by garbage, some of which decodes: whatever a request
+	// ends in, it gets its answer and the next request is served.
+	for (unsigned key = 0; key < 16; ++key)
+	{
+		Bytes damaged(64, 0xFF);
+		damaged[0] = static_cast<unsigned char>(key);
+		exchange(connection, 'D', SmartCompresser::Smart, damaged, response);
+	}
+
+	Bytes packed;
+	CHECK(exchange(connection, 'C', SmartCompresser::HuffmanCoding, data, packed));
+	CHECK(exchange(connection, 'D', SmartCompresser::Smart, packed, response));
+	CHECK(response == data);
+	close(connection);
+}
+
+/// Whether something arrives on connection within milliseconds.
+static bool readable(int connection, int milliseconds)
+{
+	pollfd descriptor = { connection, POLLIN, 0 };
+	return poll(&descriptor, 1, milliseconds) == 1;
+}
+
+TEST(serverLimitsConnections)
+{
+	const std::string path = testPath("sock");
+	WorkerPool<SmartCompresser> pool(1, workerFactory(CompresserOptions()));
+	CompressionServer<SmartCompresser> server(pool, 2);
+	int result = EXIT_FAILURE;
+	std::thread serving([&]() { result = server.run(path); });
+
+	const Bytes data = textSample(1000);
+	Bytes response;
+	const int first = connectTo(path);
+	const int second = connectTo(path);
+	CHECK(exchange(first, 'C', SmartCompresser::Smart, data, response));
+	CHECK(exchange(second, 'C', SmartCompresser::Smart, data, response));
+
+	// The third waits in the backlog until one of the others is closed.
+	const int third = connectTo(path);
+	const Bytes request = { 'C', SmartCompresser::NoCompression, 0, 0, 0, 0 };
+	CHECK(send(third, request.data(), request.size(), 0) == static_cast<ssize_t>(request.size()));
+	CHECK(!readable(third, 200));
+
+	close(first);
+	CHECK(readable(third, 10000));
+
+	server.stop();
+	serving.join();
+	CHECK(result == EXIT_SUCCESS);
+
+	// Stopping closed the connections that were still open.
+	unsigned char byte;
+	CHECK(recv(second, &byte, 1, 0) == 0);
+	close(second);
+	close(third);
+}
+
+TEST(serverStops)
+{
+	const std::string path = testPath("sock");
+	WorkerPool<SmartCompresser> pool(2, workerFactory(CompresserOptions()));
+	CompressionServer<SmartCompresser> server(pool);
+	int result = EXIT_FAILURE;
+	std::thread serving([&]() { result = server.run(path); });
+
+	const int connection = connectTo(path);
+	const Bytes data = textSample(100000);
+	Bytes packed;
+	CHECK(exchange(connection, 'C', SmartCompresser::HuffmanCoding, data, packed));
+
+	server.stop();
+	serving.join();
+	CHECK(result == EXIT_SUCCESS);
+	close(connection);
+
+	// Stopped before it runs, run returns at once.
+	CompressionServer<SmartCompresser> stopped(pool);
+	stopped.stop();
+	CHECK(stopped.run(testPath("stopped.sock")) == EXIT_SUCCESS);
+}
+
+TEST(serverKeepsOtherFiles)
+{
+	writeFile("server.file", textSample(100));
+
+	WorkerPool<SmartCompresser> pool(1, workerFactory(CompresserOptions()));
+	CompressionServer<SmartCompresser> server(pool);
+	CHECK(server.run("server.file") == EXIT_FAILURE);
+	CHECK(readFile("server.file") == textSample(100));
+
+	std::remove("server.link");
+	CHECK(symlink("server.file", "server.link") == 0);
+	CHECK(server.run("server.link") == EXIT_FAILURE);
+	CHECK(readFile("server.link") == textSample(100));
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstdio>
+#include <sstream>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+#include <string>
+#include <vector>
+
+/// Minimal test registry. TEST defines a case that registers itself by name, CHECK fails
+/// the running case with its location. Each case is registered with CTest on its own, so
+/// one that hangs is stopped by the timeout without hiding the others.
+class TestFailure : public std::runtime_error
+{
+public:
+	explicit TestFailure(const std::string& what) : std::runtime_error(what)
+	{
+	}
+};
+
+struct TestCase
+{
+	const char* name;
+	void(*run)();
+};
+
+inline std::vector<TestCase>& testCases()
+{
+	static std::vector<TestCase> cases;
+	return cases;
+}
+
+/// Name of the case being run. Cases write their files under testPath, so the ones
+/// CTest runs in parallel in the same directory do not overwrite each other's files.
+inline std::string& currentTest()
+{
+	static std::string name;
+	return name;
+}
+
+inline std::string testPath(const std::string& suffix)
+{
+	return currentTest() + "." + suffix;
+}
+
+struct TestRegistration
+{
+	TestRegistration(const char* name, void(*run)())
+	{
+		const TestCase test = { name, run };
+		testCases().push_back(test);
+	}
+};
+
+#define TEST(name) \
+	static void name(); \
+	static TestRegistration name##Registration(#name, name); \
+	static void name()
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			std::ostringstream message; \
+			message << __FILE__ << ":" << __LINE__ << ": " << #condition; \
+			throw TestFailure(message.str()); \
+		} \
+	} while (false)
+
+typedef std::vector<unsigned char> Bytes;
+
+/// Deterministic generator, the samples are the same on every run and platform.
+class TestRandom
+{
+public:
+	explicit TestRandom(std::uint32_t seed) : state(seed)
+	{
+	}
+
+	std::uint32_t next()
+	{
+		state = state * 1664525u + 1013904223u;
+		return state >> 8;
+	}
+
+private:
+	std::uint32_t state;
+};
+
+/// Words with a skewed frequency, compressible the way text is.
+inline Bytes textSample(size_t size, std::uint32_t seed = 1)
+{
+	static const char* const words[] = { "the ", "compresser ", "of ", "block ", "and ", "a ", "stream ",
+		"huffman ", "to ", "dictionary ", "in ", "is ", "container\n", "with ", "codec ", "for " };
+	TestRandom random(seed);
+	Bytes data;
+	while (data.size() < size)
+	{
+		const std::uint32_t pick = random.next();
+		const char* word = words[std::min(pick & 15, (pick >> 4) & 15)];
+		for (; *word && data.size() < size; ++word)
+			data.push_back(static_cast<unsigned char>(*word));
+	}
+	return data;
+}
+
+inline Bytes randomSample(size_t size, std::uint32_t seed = 2)
+{
+	TestRandom random(seed);
+	Bytes data(size);
+	for (size_t i = 0; i < size; ++i)
+		data[i] = static_cast<unsigned char>(random.next());
+	return data;
+}
+
+/// 16 bit little endian PCM: a slow wave with some noise.
+inline Bytes audioSample(size_t samples, std::uint32_t seed = 3)
+{
+	TestRandom random(seed);
+	Bytes data;
+	int value = 0;
+	int step = 40;
+	for (size_t i = 0; i < samples; ++i)
+	{
+		if (value > 12000 || value < -12000)
+			step = -step;
+		value += step + static_cast<int>(random.next() % 64) - 32;
+		data.push_back(static_cast<unsigned char>(value & 0xFF));
+		data.push_back(static_cast<unsigned char>((value >> 8) & 0xFF));
+	}
+	return data;
+}
+
+/// Appends the low bytes of value, little endian.
+inline void writeValueAt(Bytes& data, std::uint64_t value, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; ++i)
+		data.push_back(static_cast<unsigned char>(value >> (8 * i)));
+}
+
+inline void writeFile(const std::string& path, const Bytes& data)
+{
+	std::ofstream os(path, std::ios_base::binary | std::ios_base::trunc);
+	os.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+	if (!os)
+		throw TestFailure("cannot write " + path);
+}
+
+inline Bytes readFile(const std::string& path)
+{
+	std::ifstream is(path, std::ios_base::binary);
+	return Bytes(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+}
+
+inline bool fileExists(const std::string& path)
+{
+	std::ifstream is(path, std::ios_base::binary);
+	return is.is_open();
+}
+
+/// Creates the directory if it does not exist yet.
+inline void makeDirectory(const std::string& path)
+{
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,46 @@
+// Tests.cpp : Runs the test cases by name, or all of them without an argument.
+//
+
+#define SMARTCOMPRESSER_NO_MAIN
+#include "../SmartCompresser/SmartCompresser.cpp"
+
+#include "Test.h"
+#include "CodecTests.cpp"
+#include "CommandLineTests.cpp"
+#include "ContainerTests.cpp"
+#include "DedupTests.cpp"
+#include "ArchiveTests.cpp"
+#include "ServerTests.cpp"
+
+int main(int argc, char* argv[])
+{
+	int failed = 0;
+	bool found = false;
+
+	for (const TestCase& test : testCases())
+	{
+		if (argc > 1 && std::string(argv[1]) != test.name)
+			continue;
+
+		found = true;
+		currentTest() = test.name;
+		try
+		{
+			test.run();
+			std::cout << "passed " << test.name << std::endl;
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << "FAILED " << test.name << ": " << e.what() << std::endl;
+			++failed;
+		}
+	}
+
+	if (!found)
+	{
+		std::cout << "no test named " << argv[1] << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file